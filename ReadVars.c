@@ -16,57 +16,53 @@
 #include <sha256.h>
 #include "efiauthenticated.h"
 
+static CHAR16 *type_names[] = {
+	[ESL_TYPE_UNKNOWN] = L"Unknown",
+	[ESL_TYPE_X509] = L"X509",
+	[ESL_TYPE_RSA2048] = L"RSA2048",
+	[ESL_TYPE_PKCS7] = L"PKCS7",
+	[ESL_TYPE_SHA256] = L"SHA256",
+};
+
 void
 parse_db(UINT8 *data, UINTN len, EFI_HANDLE image, CHAR16 *name, int save_file)
 {
-	EFI_SIGNATURE_LIST  *CertList = (EFI_SIGNATURE_LIST *)data;
 	EFI_SIGNATURE_DATA  *Cert;
-	UINTN count = 0, DataSize = len;
 	EFI_FILE *file;
 	CHAR16 *buf = AllocatePool(StrSize(name) + 4 + 2 + 4 + 8 +100);
 	CHAR16 *ext;
 	EFI_STATUS status;
-	int size;
-
-	certlist_for_each_certentry(CertList, data, size, DataSize) {
-		int Index = 0;
-		count++;
-
-		if (CompareGuid(&CertList->SignatureType, &X509_GUID) == 0) {
-			ext = L"X509";
-		} else if (CompareGuid(&CertList->SignatureType, &RSA2048_GUID) == 0) {
-			ext = L"RSA2048";
-		} else if (CompareGuid(&CertList->SignatureType, &PKCS7_GUID) == 0) {
-			ext = L"PKCS7";
-		} else if (CompareGuid(&CertList->SignatureType, &EFI_CERT_SHA256_GUID) == 0) {
-			ext = L"SHA256";
-		} else {
-			ext = L"Unknown";
-		}
+	esl_view view;
+	esl_list l;
+	UINTN Index;
+
+	if (esl_view_init(&view, data, len) != EFI_SUCCESS)
+		Print(L"%s: malformed signature list after list %d\n",
+		      name, view.lists);
+
+	esl_view_for_each_list(&view, &l) {
+		ext = type_names[l.type];
 
-		Print(L"%s: List %d, type %s\n", name, count, ext);
+		Print(L"%s: List %d, type %s\n", name, l.index + 1, ext);
 
-		certentry_for_each_cert(Cert, CertList) {
+		esl_list_for_each_entry(&l, Cert, Index) {
 			Print(L"    Signature %d, size %d, owner %g\n",
-			      Index++, CertList->SignatureSize,
-			      &Cert->SignatureOwner);
+			      Index, l.entry_size, &Cert->SignatureOwner);
 
-			if (StrCmp(ext, L"X509") == 0) {
+			if (l.type == ESL_TYPE_X509) {
 				CHAR16 buf1[4096];
 
-				x509_to_str(Cert->SignatureData,
-					    CertList->SignatureSize,
+				x509_to_str(Cert->SignatureData, l.data_size,
 					    X509_OBJ_SUBJECT, buf1,
 					    sizeof(buf1));
 				Print(L"        Subject: %s\n", buf1);
 
-				x509_to_str(Cert->SignatureData,
-					    CertList->SignatureSize,
+				x509_to_str(Cert->SignatureData, l.data_size,
 					    X509_OBJ_ISSUER, buf1,
 					    sizeof(buf1));
 				Print(L"        Issuer: %s\n", buf1);
 				
-			} else if (StrCmp(ext, L"SHA256") == 0) {
+			} else if (l.type == ESL_TYPE_SHA256) {
 				CHAR16 buf1[256];
 
 				StrCpy(buf1, L"Hash: ");
@@ -75,14 +71,14 @@ parse_db(UINT8 *data, UINTN len, EFI_HANDLE image, CHAR16 *name, int save_file)
 			}
 
 			if (save_file) {
-				SPrint(buf, 0, L"%s-%d-%d-%s-%g", name, count, Index, ext, &Cert->SignatureOwner);
+				SPrint(buf, 0, L"%s-%d-%d-%s-%g", name, l.index + 1, Index + 1, ext, &Cert->SignatureOwner);
 				Print(L"Writing to file %s\n", buf);
 				status = simple_file_open(image, buf, &file, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE);
 				if (status != EFI_SUCCESS) {
 					Print(L"Failed to open file %s: %d\n", buf, status);
 					continue;
 				}
-				status = simple_file_write_all(file, CertList->SignatureSize-sizeof(EFI_GUID), Cert->SignatureData);
+				status = simple_file_write_all(file, l.data_size, Cert->SignatureData);
 				simple_file_close(file);
 				if (status != EFI_SUCCESS) {
 					Print(L"Failed to write signature to file %s: %d\n", buf, status);
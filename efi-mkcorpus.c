@@ -0,0 +1,340 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ */
+#define _GNU_SOURCE		/* for strptime */
+#include <stdint.h>
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#include <PeImage.h>
+#include <variables.h>
+#include <guid.h>
+#include <synth.h>
+#include <varsign.h>
+#include <version.h>
+
+static void
+usage(const char *progname)
+{
+	printf("Usage: %s [-s <seed>] [-n <count>] [-S <sections>] [-r] [-x <crt>] [-g <guid>] [-a] [-t <timestamp>] [-c <crt file>] [-k <key file>] [-v <var>] pe|esl|auth <size> <output>\n", progname);
+}
+
+static void
+help(const char *progname)
+{
+	usage(progname);
+	printf("Generate synthetic EFI binaries, signature lists or signed variable\n"
+	       "updates for benchmarking and testing.  The output only depends on the\n"
+	       "options, so the same seed always gives the same files.\n\n"
+	       "\tpe <size>\ta PE32+ image of about <size> bytes\n"
+	       "\tesl <size>\ta signature list of <size> entries\n"
+	       "\tauth <size>\ta signed update of <var> with <size> entries\n\n"
+	       "<size> may end in k, M or G.\n\n"
+	       "Options:\n"
+	       "\t-s <seed>\tseed the generator with <seed> (default 1)\n"
+	       "\t-n <count>\tgenerate <count> files, <output>.0 to <output>.<count-1>\n"
+	       "\t-S <sections>\tspread the image over <sections> sections (default 4)\n"
+	       "\t-r\t\tcover the first section with relocations\n"
+	       "\t-x <crt>\tmake X509 entries, all variants of certificate <crt>,\n"
+	       "\t\t\tinstead of sha256 hashes\n"
+	       "\t-g <guid>\tuse <guid> as the signature owner\n"
+	       "\t-a\t\tprepare the update for APPEND_WRITE\n"
+	       "\t-t <timestamp>\ttimestamp of the update (default 2013-01-01 00:00:00)\n"
+	       "\t-c <crt>\tsigning certificate for the update in PEM format\n"
+	       "\t-k <key>\tkey for <crt> in PEM format\n"
+	       "\t-v <var>\tthe variable the update is for (default db)\n"
+	       );
+}
+
+static UINTN
+parse_size(const char *str)
+{
+	char *end;
+	UINTN size = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'G':
+		size *= 1024;
+		/* fall through */
+	case 'M':
+		size *= 1024;
+		/* fall through */
+	case 'k':
+		size *= 1024;
+	}
+	return size;
+}
+
+static X509 *
+read_cert(const char *file)
+{
+	BIO *bio = BIO_new_file(file, "r");
+	X509 *cert = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+
+	if (!cert) {
+		fprintf(stderr, "error reading certificate %s\n", file);
+		exit(1);
+	}
+	BIO_free(bio);
+	return cert;
+}
+
+/* the DER of cert and where in it the serial number's bytes are */
+static unsigned char *
+cert_template(X509 *cert, int *len, UINTN *serial, UINTN *serial_len)
+{
+	ASN1_INTEGER *s = X509_get_serialNumber(cert);
+	unsigned char *der = NULL, *sder = NULL, *p;
+	int slen;
+
+	*len = i2d_X509(cert, &der);
+	slen = i2d_ASN1_INTEGER(s, &sder);
+	/* the serial is the first INTEGER with its encoding in the cert */
+	p = (*len > 0 && slen > 0) ? memmem(der, *len, sder, slen) : NULL;
+	if (!p) {
+		fprintf(stderr, "failed to find the serial number in the certificate\n");
+		exit(1);
+	}
+	/* just the contents, after the tag and length */
+	*serial_len = ASN1_STRING_length(s);
+	*serial = p - der + slen - *serial_len;
+	OPENSSL_free(sder);
+	return der;
+}
+
+/*
+ * Sign esl as an update of var the way sign-efi-sig-list does and return
+ * the complete EFI_VARIABLE_AUTHENTICATION_2 header plus payload.
+ */
+static void *
+sign_esl(char *var, EFI_GUID *vendor, UINT32 attributes, EFI_TIME *timestamp,
+	 void *esl, UINTN esllen, X509 *cert, EVP_PKEY *pkey, UINTN *len)
+{
+	void *update = variable_sign_update(var, vendor, attributes, timestamp,
+					    esl, esllen, cert, pkey,
+					    PKCS7_NOATTR, 0, len);
+
+	if (!update) {
+		fprintf(stderr, "failed to sign the update of %s\n", var);
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+	return update;
+}
+
+static void
+write_file(const char *file, void *buf, UINTN len)
+{
+	int fd = open(file, O_CREAT|O_WRONLY|O_TRUNC, S_IWUSR|S_IRUSR);
+
+	if (fd == -1) {
+		fprintf(stderr, "failed to open %s: ", file);
+		perror("");
+		exit(1);
+	}
+	if (write(fd, buf, len) != len) {
+		fprintf(stderr, "failed to write %s: ", file);
+		perror("");
+		exit(1);
+	}
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *progname = argv[0];
+	char *type, *outfile, *x509file = NULL, *certfile = NULL,
+		*keyfile = NULL, *timestampstr = "2013-01-01 00:00:00",
+		*var = "db";
+	unsigned long long seed = 1;
+	int i, count = 1, sections = 4, relocs = 0, certlen = 0;
+	UINTN size, serial = 0, serial_len = 0;
+	unsigned char *certder = NULL;
+	EFI_GUID owner = MOK_OWNER, *vendor;
+	UINT32 attributes = EFI_VARIABLE_NON_VOLATILE
+		| EFI_VARIABLE_RUNTIME_ACCESS
+		| EFI_VARIABLE_BOOTSERVICE_ACCESS
+		| EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
+	EFI_TIME timestamp = { 0 };
+	X509 *cert = NULL;
+	EVP_PKEY *pkey = NULL;
+
+	while (argc > 1) {
+		if (strcmp("--version", argv[1]) == 0) {
+			version(progname);
+			exit(0);
+		} else if (strcmp("--help", argv[1]) == 0) {
+			help(progname);
+			exit(0);
+		} else if (strcmp("-s", argv[1]) == 0 && argc > 2) {
+			seed = strtoull(argv[2], NULL, 0);
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-n", argv[1]) == 0 && argc > 2) {
+			count = atoi(argv[2]);
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-S", argv[1]) == 0 && argc > 2) {
+			sections = atoi(argv[2]);
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-r", argv[1]) == 0) {
+			relocs = 1;
+			argv += 1;
+			argc -= 1;
+		} else if (strcmp("-x", argv[1]) == 0 && argc > 2) {
+			x509file = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-g", argv[1]) == 0 && argc > 2) {
+			if (str_to_guid(argv[2], &owner)) {
+				fprintf(stderr, "Invalid GUID %s\n", argv[2]);
+				exit(1);
+			}
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-a", argv[1]) == 0) {
+			attributes |= EFI_VARIABLE_APPEND_WRITE;
+			argv += 1;
+			argc -= 1;
+		} else if (strcmp("-t", argv[1]) == 0 && argc > 2) {
+			timestampstr = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-c", argv[1]) == 0 && argc > 2) {
+			certfile = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-k", argv[1]) == 0 && argc > 2) {
+			keyfile = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-v", argv[1]) == 0 && argc > 2) {
+			var = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else {
+			break;
+		}
+	}
+
+	if (argc != 4 || count < 1 || sections < 1) {
+		usage(progname);
+		exit(1);
+	}
+
+	type = argv[1];
+	size = parse_size(argv[2]);
+	outfile = argv[3];
+
+	if (strcmp(type, "pe") != 0 && strcmp(type, "esl") != 0
+	    && strcmp(type, "auth") != 0) {
+		fprintf(stderr, "Unknown type %s\n", type);
+		usage(progname);
+		exit(1);
+	}
+
+	ERR_load_crypto_strings();
+	OpenSSL_add_all_digests();
+	OpenSSL_add_all_ciphers();
+	ERR_clear_error();
+
+	if (x509file) {
+		X509 *x = read_cert(x509file);
+
+		certder = cert_template(x, &certlen, &serial, &serial_len);
+		X509_free(x);
+	}
+
+	vendor = get_owner_guid(var);
+	if (strcmp(type, "auth") == 0) {
+		BIO *bio;
+		struct tm tm;
+
+		if (!keyfile || !certfile) {
+			fprintf(stderr, "Doing signing, need certificate and key\n");
+			exit(1);
+		}
+		if (!vendor) {
+			fprintf(stderr, "Unknown variable %s\n", var);
+			exit(1);
+		}
+		cert = read_cert(certfile);
+		bio = BIO_new_file(keyfile, "r");
+		pkey = bio ? PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL) : NULL;
+		if (!pkey) {
+			fprintf(stderr, "error reading private key %s\n", keyfile);
+			exit(1);
+		}
+		BIO_free(bio);
+
+		/* for append update timestamp should be zero */
+		if (!(attributes & EFI_VARIABLE_APPEND_WRITE)) {
+			memset(&tm, 0, sizeof(tm));
+			if (!strptime(timestampstr, "%Y-%m-%d %H:%M:%S", &tm)) {
+				fprintf(stderr, "Invalid timestamp %s\n",
+					timestampstr);
+				exit(1);
+			}
+			timestamp.Year = tm.tm_year + 1900;
+			timestamp.Month = tm.tm_mon + 1;
+			timestamp.Day = tm.tm_mday;
+			timestamp.Hour = tm.tm_hour;
+			timestamp.Minute = tm.tm_min;
+			timestamp.Second = tm.tm_sec;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		char name[4096];
+		void *buf, *esl;
+		UINTN len;
+
+		/* each file gets its own stream, so one can be regenerated
+		 * without the others */
+		synth_seed(seed + i);
+		if (count == 1)
+			snprintf(name, sizeof(name), "%s", outfile);
+		else
+			snprintf(name, sizeof(name), "%s.%d", outfile, i);
+
+		if (strcmp(type, "pe") == 0) {
+			buf = synth_pe_image(size, sections, relocs, &len, NULL);
+		} else if (x509file) {
+			buf = synth_x509_esl(size, certder, certlen, serial,
+					     serial_len, &owner, &len);
+		} else {
+			buf = synth_sha256_esl(size, &owner, &len);
+		}
+		if (!buf) {
+			fprintf(stderr, "failed to generate %s\n", name);
+			exit(1);
+		}
+		if (strcmp(type, "auth") == 0) {
+			esl = buf;
+			buf = sign_esl(var, vendor, attributes, &timestamp,
+				       esl, len, cert, pkey, &len);
+			free(esl);
+		}
+		write_file(name, buf, len);
+		free(buf);
+	}
+
+	return 0;
+}
@@ -14,6 +14,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <endian.h>
 
 #include <openssl/x509.h>
 
@@ -23,6 +24,7 @@
 #include <kernel_efivars.h>
 #include <guid.h>
 #include <sha256.h>
+#include <esl.h>
 #include <version.h>
 #include "efiauthenticated.h"
 
@@ -31,7 +33,8 @@
 static void
 usage(const char *progname)
 {
-	printf("Usage: %s: [-v <var>] [-s <list>[-<entry>]] [-o <file>]\n", progname);
+	printf("Usage: %s: [-v <var>] [-s <list>[-<entry>]] [-o <file>] [-p <dir>]\n"
+	       "       %s: [-p <dir>] -a <archive>\n", progname, progname);
 }
 
 static void
@@ -44,51 +47,41 @@ help(const char *progname)
 	       "\t-s <list>[-<entry>]\tlist only a given signature list (and optionally\n"
 	       "\t\tonly a given entry in that list\n"
 	       "\t-o <file>\toutput the requested signature lists to <file>\n"
+	       "\t-p <dir>\tread the variables from the efivarfs mounted at <dir>\n"
+	       "\t-a <archive>\tsnapshot every variable into <archive> (- for stdout)\n"
 	       );
 }
 
 void
 parse_db(const char *name, uint8_t *data, uint32_t len, int sig, int entry)
 {
-	EFI_SIGNATURE_LIST  *CertList = (EFI_SIGNATURE_LIST *)data;
 	EFI_SIGNATURE_DATA  *Cert;
-	long count = 0, DataSize = len;
-	int size;
+	esl_view view;
+	esl_list l;
+	UINTN Index;
 
-	certlist_for_each_certentry(CertList, data, size, DataSize) {
-		int Index = 0;
-		const char *ext;
+	if (esl_view_init(&view, data, len) != EFI_SUCCESS)
+		fprintf(stderr, "%s: malformed signature list after list %ld\n",
+			name, (long)view.lists);
 
-		if (sig != -1 && count != sig)
+	esl_view_for_each_list(&view, &l) {
+		if (sig != -1 && (int)l.index != sig)
 			continue;
 
+		printf("%s: List %ld, type %s\n", name, (long)l.index,
+		       esl_type_name(l.type));
 
-		if (compare_guid(&CertList->SignatureType, &X509_GUID)== 0) {
-			ext = "X509";
-		} else if (compare_guid(&CertList->SignatureType, &RSA2048_GUID) == 0) {
-			ext = "RSA2048";
-		} else if (compare_guid(&CertList->SignatureType, &PKCS7_GUID) == 0) {
-			ext = "PKCS7";
-		} else if (compare_guid(&CertList->SignatureType, &EFI_CERT_SHA256_GUID) == 0) {
-			ext = "SHA256";
-		} else {
-			ext = "Unknown";
-		}
-
-		printf("%s: List %ld, type %s\n", name, count++, ext);
-
-		certentry_for_each_cert(Cert, CertList) {
-			if (entry != -1 && Index != entry)
+		esl_list_for_each_entry(&l, Cert, Index) {
+			if (entry != -1 && (int)Index != entry)
 				continue;
 
 			printf("    Signature %d, size %d, owner %s\n",
-			      Index++, CertList->SignatureSize,
+			      (int)Index, (int)l.entry_size,
 			      guid_to_str(&Cert->SignatureOwner));
 
-			if (strcmp(ext, "X509") == 0) {
+			if (l.type == ESL_TYPE_X509) {
 				const unsigned char *buf = (unsigned char *)Cert->SignatureData;
-				X509 *X = d2i_X509(NULL, &buf,
-						   CertList->SignatureSize);
+				X509 *X = d2i_X509(NULL, &buf, l.data_size);
 				X509_NAME *issuer = X509_get_issuer_name(X);
 				X509_NAME *subject = X509_get_subject_name(X);
 				
@@ -98,7 +91,7 @@ parse_db(const char *name, uint8_t *data, uint32_t len, int sig, int entry)
 				X509_NAME_print_ex_fp(stdout, issuer, 12, XN_FLAG_SEP_CPLUS_SPC);
 				printf("\n");
 
-			} else if (strcmp(ext, "SHA256") == 0) {
+			} else if (l.type == ESL_TYPE_SHA256) {
 				uint8_t *hash = Cert->SignatureData;
 				int j;
 
@@ -112,13 +105,68 @@ parse_db(const char *name, uint8_t *data, uint32_t len, int sig, int entry)
 	}
 }
 
+static int
+archive_variable(const char *var, EFI_GUID *guid, uint32_t attributes,
+		 uint32_t size, uint8_t *data, void *arg)
+{
+	struct efivars_archive_record r;
+	FILE *f = arg;
+
+	r.name_len = htole32(strlen(var));
+	r.guid.Data1 = htole32(guid->Data1);
+	r.guid.Data2 = htole16(guid->Data2);
+	r.guid.Data3 = htole16(guid->Data3);
+	memcpy(r.guid.Data4, guid->Data4, sizeof(r.guid.Data4));
+	r.attributes = htole32(attributes);
+	r.data_len = htole32(size);
+	if (fwrite(&r, sizeof(r), 1, f) != 1
+	    || fwrite(var, strlen(var), 1, f) != 1
+	    || (size && fwrite(data, size, 1, f) != 1))
+		return errno ? errno : EIO;
+	return 0;
+}
+
+/* every variable in the store, in one pass, into one archive */
+static void
+snapshot(const char *archive)
+{
+	struct efivars_archive_record end;
+	FILE *f = stdout;
+
+	if (strcmp(archive, "-") != 0) {
+		f = fopen(archive, "w");
+		if (!f) {
+			fprintf(stderr, "failed to open %s: ", archive);
+			perror("");
+			exit(1);
+		}
+	}
+	/* the records are small; write them out in big chunks */
+	setvbuf(f, NULL, _IOFBF, 64 * 1024);
+
+	memset(&end, 0, sizeof(end));
+	if (fwrite(EFIVARS_ARCHIVE_MAGIC, strlen(EFIVARS_ARCHIVE_MAGIC), 1, f) != 1
+	    || (errno = kernel_variable_for_each(archive_variable, f)) != 0
+	    || fwrite(&end, sizeof(end), 1, f) != 1
+	    || fflush(f) != 0) {
+		fprintf(stderr, "failed to write %s: ", archive);
+		perror("");
+		exit(1);
+	}
+	if (f != stdout)
+		fclose(f);
+}
+
 int
 main(int argc, char *argv[])
 {
   char *variables[] = { "PK", "KEK", "db", "dbx" , "MokList" };
-	char *progname = argv[0], *var = NULL, *file = NULL;
+	char *progname = argv[0], *var = NULL, *file = NULL,
+		*efivarfs = NULL, *archive = NULL;
 	EFI_GUID *owners[] = { &GV_GUID, &GV_GUID, &SIG_DB, &SIG_DB, &MOK_OWNER };
 	int i, found = 0, sig = -1, entry = -1, fd;
+	uint8_t *buf = NULL;	/* reused for every variable */
+	uint32_t bufsize = 0;
 
 	while (argc > 1 && argv[1][0] == '-') {
 		if (strcmp("--version", argv[1]) == 0) {
@@ -135,6 +183,14 @@ main(int argc, char *argv[])
 			sscanf(argv[2], "%d-%d", &sig, &entry);
 			argv += 2;
 			argc -= 2;
+		} else if (strcmp(argv[1], "-p") == 0) {
+			efivarfs = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp(argv[1], "-a") == 0) {
+			archive = argv[2];
+			argv += 2;
+			argc -= 2;
 		} else if (strcmp(argv[1], "-o") == 0) {
 			file = argv[2];
 			argv += 2;
@@ -150,6 +206,11 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (archive && (var || file || sig != -1)) {
+		fprintf(stderr, "-a can't be used with -v, -s or -o\n");
+		exit(1);
+	}
+
 	if (sig != -1 && !var) {
 		fprintf(stderr, "need -v <var> with -s option\n");
 		exit(1);
@@ -164,18 +225,26 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (efivarfs && (errno = kernel_variable_set_path(efivarfs))) {
+		fprintf(stderr, "Failed to open efivarfs at %s: ", efivarfs);
+		perror("");
+		exit(1);
+	}
 	kernel_variable_init();
+	if (archive) {
+		snapshot(archive);
+		return 0;
+	}
 	for (i = 0; i < ARRAY_SIZE(owners); i++) {
 		int status;
 		uint32_t len;
-		uint8_t *buf;
 
 		if (var && strcmp(var, variables[i]) != 0)
 			continue;
 
 		found = 1;
-		status = get_variable_alloc(variables[i], owners[i], NULL,
-					    &len, &buf);
+		status = get_variable_buf(variables[i], owners[i], NULL,
+					  &len, &buf, &bufsize);
 		if (status == ENOENT) {
 			printf("Variable %s has no entries\n", variables[i]);
 			continue;
@@ -188,8 +257,8 @@ main(int argc, char *argv[])
 			write(fd, buf, len);
 		else
 			parse_db(variables[i], buf, len, sig, entry);
-		free(buf);
 	}
+	free(buf);
 	if (file)
 		close(fd);
 	if (!found) {
@@ -26,15 +26,350 @@
 #include <kernel_efivars.h>
 #include <guid.h>
 #include <sha256.h>
+#include <esl.h>
+#include <digest_cache.h>
+#include <varsign.h>
 #include <version.h>
 #include "efiauthenticated.h"
 
 #define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
 
+/*
+ * Index the entries of the lists in esl that have the same type and
+ * size as target, so entries of other types that happen to have the
+ * same bytes don't count.
+ */
+static void
+index_lists(esl_view *cur, esl_list *target, esl_index *idx)
+{
+	esl_list l;
+	uint8_t *match = malloc(cur->size ? cur->size : 1), *p = match;
+
+	if (!match) {
+		fprintf(stderr, "failed to allocate %lu bytes\n",
+			(unsigned long)cur->size);
+		exit(1);
+	}
+	esl_view_for_each_list(cur, &l) {
+		if (l.type != target->type || l.entry_size != target->entry_size
+		    || (l.type == ESL_TYPE_UNKNOWN
+			&& compare_guid(&l.list->SignatureType,
+					&target->list->SignatureType) != 0))
+			continue;
+		memcpy(p, l.list, l.list->SignatureListSize);
+		p += l.list->SignatureListSize;
+	}
+	if (esl_index_build(idx, match, p - match, target->data_size)
+	    != EFI_SUCCESS) {
+		fprintf(stderr, "failed to index %lu byte signatures\n",
+			(unsigned long)target->entry_size);
+		exit(1);
+	}
+	free(match);
+}
+
+/*
+ * The entries of target that cur doesn't have, as a signature list to
+ * append: one list for each list of target that has anything missing.
+ */
+static uint8_t *
+esl_delta(uint8_t *cur, uint32_t cur_len, uint8_t *target, int target_len,
+	  int *delta_len)
+{
+	EFI_SIGNATURE_DATA *Cert;
+	uint8_t *delta = malloc(target_len ? target_len : 1), *p = delta;
+	esl_view cur_view, target_view;
+	esl_list l;
+	UINTN i;
+
+	if (!delta) {
+		fprintf(stderr, "failed to allocate %d bytes\n", target_len);
+		exit(1);
+	}
+	if (esl_view_init(&target_view, target, target_len) != EFI_SUCCESS) {
+		fprintf(stderr, "signature list %lu is malformed\n",
+			(unsigned long)target_view.lists);
+		exit(1);
+	}
+	/* a damaged variable is compared as far as it goes */
+	esl_view_init(&cur_view, cur, cur_len);
+
+	esl_view_for_each_list(&target_view, &l) {
+		EFI_SIGNATURE_LIST *out = (EFI_SIGNATURE_LIST *)p;
+		esl_index idx;
+
+		if (l.list->SignatureHeaderSize != 0) {
+			fprintf(stderr, "Can't compare signature lists with a header\n");
+			exit(1);
+		}
+		index_lists(&cur_view, &l, &idx);
+		*out = *l.list;
+		p += sizeof(*out);
+		esl_list_for_each_entry(&l, Cert, i) {
+			if (esl_index_find(&idx, Cert->SignatureData)
+			    == EFI_SUCCESS)
+				continue;
+			memcpy(p, Cert, l.entry_size);
+			p += l.entry_size;
+		}
+		esl_index_free(&idx);
+		out->SignatureListSize = p - (uint8_t *)out;
+		if (out->SignatureListSize == sizeof(*out))
+			/* nothing missing from this one */
+			p = (uint8_t *)out;
+	}
+	*delta_len = p - delta;
+	return delta;
+}
+
+char *variables[] = { "PK", "KEK", "db", "dbx" };
+char *signedby[] = { "PK", "PK", "KEK", "KEK" };
+EFI_GUID *owners[] = { &GV_GUID, &GV_GUID, &SIG_DB, &SIG_DB };
+
+/* what -d asks to delete: entry -1 is the whole list */
+struct selector {
+	int list, entry;
+};
+
+/*
+ * One update of one variable: what its options asked for and, once
+ * prepared, the payload to write.  A run of efi-updatevar is a single
+ * update; a manifest is one per line.
+ */
+struct update {
+	char *var;
+	int idx;			/* of var in variables[] */
+	int line;			/* in the manifest, or 0 */
+	uint32_t attributes;
+	int esl_mode, signed_update, skip;
+	char *hash_mode, *file, *crt_file, *key_file, *cache_file,
+		*delta_file;
+	EFI_GUID guid;
+	/* the -d, -H and -O deletions, all applied in one write */
+	struct selector *selectors;
+	int nselectors;
+	uint8_t (*digests)[SHA256_DIGEST_SIZE];
+	int ndigests;
+	EFI_GUID *owners;
+	int nowners;
+	char *buf;
+	int len;
+};
+
+static void *
+grow(void *array, int count, size_t size)
+{
+	/* double at every power of two */
+	if (count & (count - 1))
+		return array;
+	array = realloc(array, (count ? count * 2 : 16) * size);
+	if (!array) {
+		fprintf(stderr, "failed to allocate selectors\n");
+		exit(1);
+	}
+	return array;
+}
+
+static void
+add_selectors(struct update *u, const char *str)
+{
+	char *copy = strdup(str), *tok, *save;
+
+	for (tok = strtok_r(copy, ", \t\n", &save); tok;
+	     tok = strtok_r(NULL, ", \t\n", &save)) {
+		struct selector sel = { -1, -1 };
+		char *end;
+
+		sel.list = strtol(tok, &end, 10);
+		if (end != tok && *end == '-') {
+			char *entry = end + 1;
+
+			sel.entry = strtol(entry, &end, 10);
+			if (end == entry)
+				end = tok;	/* nothing after the - */
+		}
+		if (end == tok || *end != '\0' || sel.list < 0
+		    || (sel.entry < 0 && strchr(tok, '-'))) {
+			fprintf(stderr, "Invalid selector %s\n", tok);
+			exit(1);
+		}
+		u->selectors = grow(u->selectors, u->nselectors,
+				    sizeof(*u->selectors));
+		u->selectors[u->nselectors++] = sel;
+	}
+	free(copy);
+}
+
+/* one or more selectors per line; # starts a comment */
+static void
+read_selectors(struct update *u, const char *file)
+{
+	FILE *f = fopen(file, "r");
+	char line[256];
+
+	if (!f) {
+		fprintf(stderr, "Failed to open selector file %s: ", file);
+		perror("");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *hash = strchr(line, '#');
+
+		if (hash)
+			*hash = '\0';
+		add_selectors(u, line);
+	}
+	fclose(f);
+}
+
+static void
+add_digest(struct update *u, const char *str)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int i, n;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		if (sscanf(str + 2 * i, "%2hhx%n", &digest[i], &n) != 1 || n != 2)
+			break;
+	if (i != SHA256_DIGEST_SIZE || str[2 * i] != '\0') {
+		fprintf(stderr, "Invalid SHA256 digest %s\n", str);
+		exit(1);
+	}
+	u->digests = grow(u->digests, u->ndigests, sizeof(*u->digests));
+	memcpy(u->digests[u->ndigests++], digest, SHA256_DIGEST_SIZE);
+}
+
+static int
+digest_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, SHA256_DIGEST_SIZE);
+}
+
+/*
+ * An entry matches a digest if it is that hash, or if it is a
+ * certificate whose SHA256 fingerprint it is.
+ */
+static int
+entry_matches(struct update *u, esl_list *l, EFI_SIGNATURE_DATA *Cert)
+{
+	uint8_t fp[SHA256_DIGEST_SIZE], *key = Cert->SignatureData;
+	int i;
+
+	for (i = 0; i < u->nowners; i++)
+		if (compare_guid(&Cert->SignatureOwner, &u->owners[i]) == 0)
+			return 1;
+	if (!u->ndigests)
+		return 0;
+	if (l->type == ESL_TYPE_X509) {
+		sha256_context ctx;
+
+		sha256_starts(&ctx);
+		sha256_update(&ctx, Cert->SignatureData, l->data_size);
+		sha256_finish(&ctx, fp);
+		key = fp;
+	} else if (l->data_size != SHA256_DIGEST_SIZE) {
+		return 0;
+	}
+	return bsearch(key, u->digests, u->ndigests, sizeof(*u->digests),
+		       digest_cmp) != NULL;
+}
+
+/*
+ * Mark everything the selectors, digests and owners pick out of the
+ * variable, then copy what is left across in a single pass, dropping
+ * lists that end up empty.
+ */
+static char *
+delete_entries(struct update *u, uint8_t *data, uint32_t len, int *out_len)
+{
+	EFI_SIGNATURE_DATA *Cert;
+	esl_view view;
+	esl_list l;
+	UINTN i, *base;
+	uint8_t *kill, *out, *p;
+	int n, matched = 0, deleted = 0;
+
+	if (esl_view_init(&view, data, len) != EFI_SUCCESS) {
+		fprintf(stderr, "%s is malformed after signature list %lu\n",
+			u->var, (unsigned long)view.lists);
+		exit(1);
+	}
+	base = malloc((view.lists + 1) * sizeof(*base));
+	kill = calloc(view.entries + 1, 1);
+	out = malloc(len ? len : 1);
+	if (!base || !kill || !out) {
+		fprintf(stderr, "failed to allocate %u bytes\n", len);
+		exit(1);
+	}
+	/* number the entries across the whole variable */
+	base[0] = 0;
+	esl_view_for_each_list(&view, &l)
+		base[l.index + 1] = base[l.index] + l.count;
+
+	for (n = 0; n < u->nselectors; n++) {
+		struct selector *sel = &u->selectors[n];
+
+		if (esl_view_list(&view, sel->list, &l) != EFI_SUCCESS
+		    || (sel->entry != -1 && sel->entry >= l.count)) {
+			if (sel->entry == -1)
+				fprintf(stderr, "signature %d does not exist in %s\n", sel->list, u->var);
+			else
+				fprintf(stderr, "signature %d-%d does not exist in %s\n", sel->list, sel->entry, u->var);
+			exit(1);
+		}
+		if (sel->entry == -1)
+			memset(kill + base[l.index], 1, l.count);
+		else
+			kill[base[l.index] + sel->entry] = 1;
+	}
+
+	if (u->ndigests || u->nowners) {
+		qsort(u->digests, u->ndigests, sizeof(*u->digests), digest_cmp);
+		esl_view_for_each_list(&view, &l)
+			esl_list_for_each_entry(&l, Cert, i)
+				if (entry_matches(u, &l, Cert)) {
+					kill[base[l.index] + i] = 1;
+					matched++;
+				}
+		if (!matched) {
+			fprintf(stderr, "No entries in %s match the given digests or owners\n", u->var);
+			exit(1);
+		}
+	}
+
+	p = out;
+	esl_view_for_each_list(&view, &l) {
+		EFI_SIGNATURE_LIST *CertList = (EFI_SIGNATURE_LIST *)p;
+		UINTN hdr = sizeof(*CertList) + l.list->SignatureHeaderSize;
+
+		memcpy(p, l.list, hdr);
+		p += hdr;
+		esl_list_for_each_entry(&l, Cert, i) {
+			if (kill[base[l.index] + i]) {
+				deleted++;
+				continue;
+			}
+			memcpy(p, Cert, l.entry_size);
+			p += l.entry_size;
+		}
+		CertList->SignatureListSize = p - (uint8_t *)CertList;
+		if (CertList->SignatureListSize == hdr)
+			/* nothing left in this list */
+			p = (uint8_t *)CertList;
+	}
+	printf("Deleting %d entries from %s\n", deleted, u->var);
+
+	free(base);
+	free(kill);
+	*out_len = p - out;
+	return (char *)out;
+}
+
 static void
 usage(const char *progname)
 {
-	printf("Usage: %s: [-a] [-e] [-d <list>[-<entry>]] [-k <key>] [-g <guid>] [-b <file>|-f <file>|-c file] <var>\n", progname);
+	printf("Usage: %s: [-a] [-e] [-d <list>[-<entry>][,...]|-d @<file>] [-H <sha256>] [-O <guid>] [-k <key>] [-g <guid>] [-C <cache>] [-o <file>] [-p <dir>] [-b <file>|-f <file>|-c file|-D <file>] <var>\n"
+	       "       %s: [-p <dir>] -M <manifest>\n", progname, progname);
 }
 
 static void
@@ -46,158 +381,480 @@ help(const char *progname)
 	       "\t-a\tappend a value to the variable instead of replacing it\n"
 	       "\t-e\tuse EFI Signature List instead of signed update (only works in Setup Mode\n"
 	       "\t-b <binfile>\tAdd hash of <binfile> to the signature list\n"
+	       "\t-C <cache>\tLook up and keep the hash of <binfile> in <cache>\n"
 	       "\t-f <file>\tAdd or Replace the key file (.esl or .auth) to the <var>\n"
 	       "\t-c <file>\tAdd or Replace the x509 certificate to the <var> (with <guid> if provided)\n"
 	       "\t-g <guid>\tOptional <guid> for the X509 Certificate\n"
 	       "\t-k <key>\tSecret key file for authorising User Mode updates\n"
 	       "\t-d <list>[-<entry>]\tDelete the signature list <list> (or just a single <entry> within the list)\n"
+	       "\t\tmay be repeated or given as a comma separated set; -d @<file> reads them from <file>\n"
+	       "\t-H <sha256>\tDelete the entries that are the hash, or certificates with the fingerprint, <sha256>\n"
+	       "\t-O <guid>\tDelete the entries owned by <guid>\n"
+	       "\t-D <file>\tAppend only the entries of the signature list <file> that <var> doesn't have yet\n"
+	       "\t-o <file>\tWrite the update (.esl, or .auth if signed) to <file> instead of <var>\n"
+	       "\t-p <dir>\tUse the efivarfs mounted at <dir>\n"
+	       "\t-M <manifest>\tApply every update in <manifest>, one per line as the options and <var>\n"
+	       "\t\tof a single run; all are prepared and signed before any is written\n"
 	       );
 }
 
-int
-main(int argc, char *argv[])
+static void
+update_init(struct update *u)
 {
-	char *variables[] = { "PK", "KEK", "db", "dbx" };
-	char *signedby[] = { "PK", "PK", "KEK", "KEK" };
-	EFI_GUID *owners[] = { &GV_GUID, &GV_GUID, &SIG_DB, &SIG_DB };
-	EFI_GUID *owner, guid = MOK_OWNER;
-	int i, esl_mode = 0, fd, ret, delsig = -1, delentry = -1;
-	struct stat st;
-	uint32_t attributes = EFI_VARIABLE_NON_VOLATILE
+	memset(u, 0, sizeof(*u));
+	u->guid = MOK_OWNER;
+	u->attributes = EFI_VARIABLE_NON_VOLATILE
 		| EFI_VARIABLE_RUNTIME_ACCESS
 		| EFI_VARIABLE_BOOTSERVICE_ACCESS
 		| EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
-	char *hash_mode = NULL, *file = NULL, *var, *progname = argv[0], *buf,
-		*name, *crt_file = NULL, *key_file = NULL;
-	
+}
 
-	while (argc > 1 && argv[1][0] == '-') {
-		if (strcmp("--version", argv[1]) == 0) {
-			version(progname);
-			exit(0);
-		} else if (strcmp("--help", argv[1]) == 0) {
-			help(progname);
-			exit(0);
-		} else if(strcmp(argv[1], "-a") == 0) {
-			attributes |= EFI_VARIABLE_APPEND_WRITE;
-			argv += 1;
-			argc -= 1;
-		} if (strcmp(argv[1], "-e") == 0) {
-			esl_mode = 1;
-			argv += 1;
-			argc -= 1;
-		} else if (strcmp(argv[1], "-b") == 0) {
-			hash_mode = argv[2];
-			argv += 2;
-			argc -= 2;
-		} else if (strcmp(argv[1], "-f") == 0) {
-			file = argv[2];
-			argv += 2;
-			argc -= 2;
-		} else if (strcmp(argv[1], "-g") == 0) {
-			if (str_to_guid(argv[2], &guid)) {
-				fprintf(stderr, "Invalid GUID %s\n", argv[2]);
+/*
+ * Take the update option at argv[1]; returns how many arguments it used,
+ * or zero if it isn't one
+ */
+static int
+update_option(struct update *u, int argc, char *argv[])
+{
+	if (strcmp(argv[1], "-a") == 0) {
+		u->attributes |= EFI_VARIABLE_APPEND_WRITE;
+		return 1;
+	} else if (strcmp(argv[1], "-e") == 0) {
+		u->esl_mode = 1;
+		return 1;
+	} else if (argc < 3) {
+		return 0;
+	} else if (strcmp(argv[1], "-b") == 0) {
+		u->hash_mode = argv[2];
+	} else if (strcmp(argv[1], "-C") == 0) {
+		u->cache_file = argv[2];
+	} else if (strcmp(argv[1], "-f") == 0) {
+		u->file = argv[2];
+	} else if (strcmp(argv[1], "-g") == 0) {
+		if (str_to_guid(argv[2], &u->guid)) {
+			fprintf(stderr, "Invalid GUID %s\n", argv[2]);
+			exit(1);
+		}
+	} else if (strcmp(argv[1], "-c") == 0) {
+		u->crt_file = argv[2];
+	} else if (strcmp(argv[1], "-k") == 0) {
+		u->key_file = argv[2];
+	} else if (strcmp(argv[1], "-d") == 0) {
+		if (argv[2][0] == '@')
+			read_selectors(u, argv[2] + 1);
+		else
+			add_selectors(u, argv[2]);
+	} else if (strcmp(argv[1], "-H") == 0) {
+		add_digest(u, argv[2]);
+	} else if (strcmp(argv[1], "-O") == 0) {
+		u->owners = grow(u->owners, u->nowners, sizeof(*u->owners));
+		if (str_to_guid(argv[2], &u->owners[u->nowners++])) {
+			fprintf(stderr, "Invalid GUID %s\n", argv[2]);
+			exit(1);
+		}
+	} else if (strcmp(argv[1], "-D") == 0) {
+		u->delta_file = argv[2];
+	} else {
+		return 0;
+	}
+	return 2;
+}
+
+/* check the variable and that the update asks for exactly one thing */
+static void
+update_check(struct update *u)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(variables); i++)
+		if (strcmp(u->var, variables[i]) == 0)
+			break;
+	if (i == ARRAY_SIZE(variables)) {
+		fprintf(stderr, "Invalid Variable %s\nVariable must be one of: ", u->var);
+		for (i = 0; i < ARRAY_SIZE(variables); i++)
+			fprintf(stderr, "%s ", variables[i]);
+		fprintf(stderr, "\n");
+		exit(1);
+	}
+	u->idx = i;
+
+	if (!(u->nselectors || u->ndigests || u->nowners)
+	    && (!!u->file + !!u->hash_mode + !!u->crt_file
+		+ !!u->delta_file != 1)) {
+		fprintf(stderr, "must specify exactly one of -f, -b, -c or -D\n");
+		exit(1);
+	}
+}
+
+/* the manifest update being read or prepared, for the report if it fails */
+static struct update *preparing;
+static const char *manifest;
+
+static void
+report_prepare_failure(void)
+{
+	if (preparing)
+		fprintf(stderr, "%s:%d: update%s%s failed; nothing was written\n",
+			manifest, preparing->line, preparing->var ? " of " : "",
+			preparing->var ? preparing->var : "");
+}
+
+/* a manifest: one update per line, '#' to the end of a line is ignored */
+static struct update *
+read_manifest(int *count)
+{
+	struct update *updates = NULL;
+	FILE *f = fopen(manifest, "r");
+	char line[4096];
+	int n = 0, lineno = 0;
+
+	if (!f) {
+		fprintf(stderr, "Failed to open manifest %s: ", manifest);
+		perror("");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *argv[64], **av, *hash = strchr(line, '#'), *save, *tok;
+		struct update *u;
+		int argc = 1, used;
+
+		lineno++;
+		if (hash)
+			*hash = '\0';
+		argv[0] = (char *)manifest;
+		for (tok = strtok_r(line, " \t\n", &save); tok;
+		     tok = strtok_r(NULL, " \t\n", &save)) {
+			if (argc == ARRAY_SIZE(argv)) {
+				fprintf(stderr, "%s:%d: too many options\n",
+					manifest, lineno);
 				exit(1);
 			}
-			argv += 2;
-			argc -= 2;
-		} else if (strcmp(argv[1], "-c") == 0) {
-			crt_file = argv[2];
-			argv += 2;
-			argc -= 2;
-		} else if (strcmp(argv[1], "-k") == 0) {
-			key_file = argv[2];
-			argv += 2;
-			argc -= 2;
-		} else if (strcmp(argv[1], "-d") == 0) {
-			sscanf(argv[2], "%d-%d", &delsig, &delentry);
-			argv += 2;
-			argc -= 2;
-		} else {
-			/* unrecognised option */
-			break;
+			/* the update keeps pointers into its arguments */
+			argv[argc++] = strdup(tok);
+		}
+		if (argc == 1)
+			continue;
+
+		updates = grow(updates, n, sizeof(*updates));
+		u = &updates[n++];
+		update_init(u);
+		u->line = lineno;
+		preparing = u;
+		av = argv;
+		while (argc > 1 && av[1][0] == '-'
+		       && (used = update_option(u, argc, av))) {
+			av += used;
+			argc -= used;
+		}
+		if (argc != 2) {
+			fprintf(stderr, "%s:%d: expected options and one variable\n",
+				manifest, lineno);
+			exit(1);
+		}
+		u->var = av[1];
+		update_check(u);
+	}
+	preparing = NULL;
+	fclose(f);
+	*count = n;
+	return updates;
+}
+
+/*
+ * Whether u replaces its variable or is built from what the variable
+ * holds before the run, rather than just appending to it
+ */
+static int
+update_exclusive(struct update *u)
+{
+	return !(u->attributes & EFI_VARIABLE_APPEND_WRITE)
+		|| u->delta_file || u->hash_mode;
+}
+
+/*
+ * Every update is prepared against the variables as they are before
+ * the run, so a second update of a variable that replaces it or looks
+ * at its contents would undo or duplicate the first.  Allow one per
+ * variable, ahead of the plain appends to it.
+ */
+static void
+check_manifest(struct update *updates, int n)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		if (!update_exclusive(&updates[i]))
+			continue;
+		for (j = 0; j < i; j++) {
+			if (updates[j].idx != updates[i].idx)
+				continue;
+			if (update_exclusive(&updates[j]))
+				fprintf(stderr, "%s:%d: %s already has an update at line %d that replaces or checks it; combine the two\n",
+					manifest, updates[i].line,
+					updates[i].var, updates[j].line);
+			else
+				fprintf(stderr, "%s:%d: this update of %s would undo or repeat the append at line %d; put it first\n",
+					manifest, updates[i].line,
+					updates[i].var, updates[j].line);
+			exit(1);
 		}
 	}
+}
+
+/*
+ * Updates signed by a variable have to be written while that variable
+ * still holds the key they were signed with, so db and dbx go first,
+ * then KEK and PK last: until PK is written the platform stays in the
+ * mode it was in when the updates were prepared.
+ */
+static int
+update_rank(struct update *u)
+{
+	return strcmp(u->var, "PK") == 0 ? 2
+		: strcmp(u->var, "KEK") == 0 ? 1 : 0;
+}
+
+static int
+update_cmp(const void *a, const void *b)
+{
+	const struct update *ua = a, *ub = b;
+
+	if (update_rank((struct update *)ua) != update_rank((struct update *)ub))
+		return update_rank((struct update *)ua)
+			- update_rank((struct update *)ub);
+	return ua->line - ub->line;
+}
+
+/*
+ * The private keys and the certificates in PK and KEK that go with them,
+ * loaded once however many updates a manifest signs with them
+ */
+struct signer {
+	char *key_file;
+	int idx;		/* of the signing variable in variables[] */
+	EVP_PKEY *pkey;
+	X509 *X;
+};
+static struct signer *signers;
+static int nsigners;
+
+static struct signer *
+find_signer(char *key_file, int i)
+{
+	struct signer *s;
+	int j;
+
+	for (j = 0; j < nsigners; j++)
+		if (strcmp(signers[j].key_file, key_file) == 0
+		    && strcmp(variables[signers[j].idx], signedby[i]) == 0)
+			return &signers[j];
+
+	signers = grow(signers, nsigners, sizeof(*signers));
+	s = &signers[nsigners++];
+	s->key_file = key_file;
+	for (s->idx = 0; strcmp(variables[s->idx], signedby[i]) != 0; s->idx++)
+		;
 
-	if (argc != 2) {
-		usage(progname);
+	BIO *key = BIO_new_file(key_file, "r");
+	s->pkey = PEM_read_bio_PrivateKey(key, NULL, NULL, NULL);
+	if (!s->pkey) {
+		fprintf(stderr, "error reading private key %s\n", key_file);
 		exit(1);
 	}
 
-	var = argv[1];
+	uint8_t *esl;
+	uint32_t esl_len;
+	int ret = get_variable_alloc(signedby[i], &GV_GUID, NULL,
+				     &esl_len, &esl);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to get %s: ", signedby[i]);
+		perror("");
+		exit(1);
+	}
+	EFI_SIGNATURE_LIST  *CertList = (EFI_SIGNATURE_LIST *)esl;
+	int DataSize = esl_len, size;
 
-	for(i = 0; i < ARRAY_SIZE(variables); i++) {
-		if (strcmp(var, variables[i]) == 0) {
-			owner = owners[i];
-			break;
+	X509 *X = NULL;
+
+	certlist_for_each_certentry(CertList, esl, size, DataSize) {
+		EFI_SIGNATURE_DATA  *Cert;
+		if (compare_guid(&CertList->SignatureType, &X509_GUID) != 0)
+			continue;
+
+		certentry_for_each_cert(Cert, CertList) {
+			const unsigned char *psig = (unsigned char *)Cert->SignatureData;
+			X = d2i_X509(NULL, &psig, CertList->SignatureSize);
+			if (X509_check_private_key(X, s->pkey))
+				goto out;
+			X = NULL;
 		}
 	}
-	if (i == ARRAY_SIZE(variables)) {
-		fprintf(stderr, "Invalid Variable %s\nVariable must be one of: ", var);
-		for (i = 0; i < ARRAY_SIZE(variables); i++)
-			fprintf(stderr, "%s ", variables[i]);
-		fprintf(stderr, "\n");
-		exit(1);
+ out:
+	if (!X) {
+		fprintf(stderr, "No public key matching %s in %s\n", key_file, signedby[i]);
+		exit (1);
 	}
+	free(esl);
+	s->X = X;
+	return s;
+}
+
+/* wrap u->buf in an authenticated variable descriptor signed by key_file */
+static void
+update_sign(struct update *u)
+{
+	struct signer *signer = find_signer(u->key_file, u->idx);
+	char *var = u->var;
+	uint32_t attributes = u->attributes;
 
-	if (delsig == -1 && (!!file + !!hash_mode + !!crt_file != 1)) {
-		fprintf(stderr, "must specify exactly one of -f, -b or -c\n");
+	EFI_TIME timestamp;
+	time_t t;
+	struct tm *tm;
+	memset(&timestamp, 0, sizeof(timestamp));
+	time(&t);
+	tm = gmtime(&t);
+	/* FIXME: currently timestamp is one year into future because of
+	 * the way we set up the secure environment  */
+	timestamp.Year = tm->tm_year + 1900 + 1;
+	timestamp.Month = tm->tm_mon + 1;
+	timestamp.Day = tm->tm_mday;
+	timestamp.Hour = tm->tm_hour;
+	timestamp.Minute = tm->tm_min;
+	timestamp.Second = tm->tm_sec;
+
+	/* the authentication header, with room in front for
+	 * set_variable_headroom() to put the attributes, then the
+	 * payload (the original esl) */
+	UINTN len;
+	char *newbuf = variable_sign_update(var, owners[u->idx], attributes,
+					    &timestamp, u->buf, u->len,
+					    signer->X, signer->pkey, 0,
+					    KERNEL_VARIABLE_HEADROOM, &len);
+	if (!newbuf) {
+		fprintf(stderr, "Failed to sign the update of %s\n", var);
+		ERR_print_errors_fp(stderr);
 		exit(1);
 	}
-			
-	kernel_variable_init();
-	ERR_load_crypto_strings();
-	OpenSSL_add_all_digests();
-	OpenSSL_add_all_ciphers();
 
-	name = file ? file : hash_mode;
-	if (delsig != -1) {
+	free(u->buf);
+	u->buf = newbuf;
+	u->len = len;
+	u->esl_mode = 0;
+	u->signed_update = 1;
+}
+
+/*
+ * Build the payload of an update, signing it if it needs it, but don't
+ * write anything.  An update with nothing to do is marked skip.
+ */
+static void
+update_prepare(struct update *u)
+{
+	int i = u->idx, fd, ret;
+	struct stat st;
+	char *name = u->file ? u->file : u->hash_mode;
+
+	if (u->nselectors || u->ndigests || u->nowners) {
 		uint32_t len;
+		uint8_t *cur;
 		int status = get_variable_alloc(variables[i], owners[i], NULL,
-						&len, (uint8_t **)&buf);
+						&len, &cur);
 		if (status == ENOENT) {
 			fprintf(stderr, "Variable %s has no entries\n", variables[i]);
 			exit(1);
 		}
-		EFI_SIGNATURE_LIST  *CertList = (EFI_SIGNATURE_LIST *)buf;
-		EFI_SIGNATURE_DATA  *Cert;
-		int size, DataSize = len, count = 0;
+		u->buf = delete_entries(u, cur, len, &u->len);
+		free(cur);
+		u->esl_mode = 1;
+	} else if (u->delta_file) {
+		uint8_t *cur = NULL;
+		uint32_t cur_len = 0;
+		int target_len;
 
-		certlist_for_each_certentry(CertList, buf, size, DataSize) {
-			int Index = 0;
+		fd = open(u->delta_file, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			fprintf(stderr, "Failed to read file %s: ", u->delta_file);
+			perror("");
+			exit(1);
+		}
+		target_len = st.st_size;
+		char *target = malloc(target_len ? target_len : 1);
+		if (!target || read(fd, target, target_len) != target_len) {
+			fprintf(stderr, "Failed to read file %s\n", u->delta_file);
+			exit(1);
+		}
+		close(fd);
 
-			if (count++ != delsig)
-				continue;
-			if (delentry == -1)
-				goto found;
-			certentry_for_each_cert(Cert, CertList) {
-				if (Index++ == delentry)
-					goto found;
+		ret = get_variable_alloc(variables[i], owners[i], NULL,
+					 &cur_len, &cur);
+		if (ret != 0 && ret != ENOENT) {
+			fprintf(stderr, "Failed to get %s: ", variables[i]);
+			perror("");
+			exit(1);
+		}
+		u->buf = (char *)esl_delta(cur, cur_len, (uint8_t *)target,
+					   target_len, &u->len);
+		free(cur);
+		free(target);
+		if (u->len == 0) {
+			fprintf(stderr, "%s already has everything in %s\n",
+				variables[i], u->delta_file);
+			u->skip = 1;
+			return;
+		}
+		u->esl_mode = 1;
+		u->attributes |= EFI_VARIABLE_APPEND_WRITE;
+	} else if (u->hash_mode) {
+		uint8_t hash[SHA256_DIGEST_SIZE];
+		struct digest_cache *cache = NULL;
+		EFI_STATUS status;
+
+		fd = open(u->hash_mode, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			fprintf(stderr, "Failed to read file %s: ", u->hash_mode);
+			perror("");
+			exit(1);
+		}
+		if (u->cache_file) {
+			cache = digest_cache_open(u->cache_file);
+			if (!cache) {
+				fprintf(stderr, "Failed to open digest cache %s: ",
+					u->cache_file);
+				perror("");
+				exit(1);
 			}
 		}
-		if (delentry == -1)
-			fprintf(stderr, "signature %d does not exist in %s\n", delsig, variables[i]);
-		else
-			fprintf(stderr, "signature %d-%d does not exist in %s\n", delsig, delentry, variables[i]);
-		exit(1);
-	found:
-		;
-		int certs = (CertList->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) - CertList->SignatureHeaderSize) / CertList->SignatureSize;
-		if (certs == 1 || delentry == -1) {
-			/* delete entire sig list + data */
-			DataSize -= CertList->SignatureListSize;
-			if (DataSize > 0)
-				memcpy(CertList,  (void *) CertList + CertList->SignatureListSize, DataSize - ((char *) CertList - buf));
-		} else {
-			int remain = DataSize - ((char *)Cert - buf) - CertList->SignatureSize;
-			/* only delete single sig */
-			DataSize -= CertList->SignatureSize;
-			CertList->SignatureListSize -= CertList->SignatureSize;
-			if (remain > 0)
-				memcpy(Cert, (void *)Cert + CertList->SignatureSize, remain);
-		}
-		st.st_size = DataSize;	/* reduce length of buf */
-		esl_mode = 1;
+		if (!digest_cache_lookup(cache, &st, hash)) {
+			/* hash straight from the file rather than reading it all in */
+			status = sha256_get_pecoff_digest_fd(fd, hash);
+			if (status != EFI_SUCCESS) {
+				fprintf(stderr, "Failed to get hash of %s\n", u->hash_mode);
+				exit(1);
+			}
+			digest_cache_insert(cache, &st, hash);
+		}
+		digest_cache_close(cache);
+		close(fd);
+
+		/* appending a hash that is already there is a no-op, so
+		 * don't bother signing and writing the update */
+		uint8_t *cur;
+		uint32_t cur_len;
+		if (get_variable_alloc(variables[i], owners[i], NULL,
+				       &cur_len, &cur) == 0) {
+			status = find_in_esl(cur, cur_len, hash,
+					     SHA256_DIGEST_SIZE);
+			free(cur);
+			if (status == EFI_SUCCESS) {
+				fprintf(stderr, "Hash of %s is already in %s\n",
+					u->hash_mode, variables[i]);
+				u->skip = 1;
+				return;
+			}
+		}
+		u->esl_mode = 1;
+		u->attributes |= EFI_VARIABLE_APPEND_WRITE;
+		u->buf = (char *)hash_to_esl(&u->guid, &u->len, hash);
 	} else if (name) {
 		fd = open(name, O_RDONLY);
 		if (fd < 0) {
@@ -209,15 +866,17 @@ main(int argc, char *argv[])
 			perror("stat failed");
 			exit(1);
 		}
-		buf = malloc(st.st_size);
-		read(fd, buf, st.st_size);
+		u->buf = malloc(st.st_size);
+		read(fd, u->buf, st.st_size);
 		close(fd);
+		u->len = st.st_size;
 	} else {
 		X509 *X = NULL;
 		BIO *bio;
+		char *crt_file = u->crt_file;
 		char *crt_file_ext = &crt_file[strlen(crt_file) - 4];
 
-		esl_mode = 1;
+		u->esl_mode = 1;
 
 		bio = BIO_new_file(crt_file, "r");
 		if (!bio) {
@@ -251,162 +910,152 @@ main(int argc, char *argv[])
 
 		EFI_SIGNATURE_DATA *sig_data = (void *)esl + sizeof(EFI_SIGNATURE_LIST);
 
-		sig_data->SignatureOwner = guid;
+		sig_data->SignatureOwner = u->guid;
 
-		buf = (char *)esl;
-		st.st_size = cert_len;
+		u->buf = (char *)esl;
+		u->len = cert_len;
 	}
 
-	if (hash_mode) {
-		uint8_t hash[SHA256_DIGEST_SIZE];
-		EFI_STATUS status;
-		int len;
-
-		esl_mode = 1;
-		attributes |= EFI_VARIABLE_APPEND_WRITE;
-		status = sha256_get_pecoff_digest_mem(buf, st.st_size, hash);
-		free(buf);
-		if (status != EFI_SUCCESS) {
-			fprintf(stderr, "Failed to get hash of %s\n", name);
+	if (u->esl_mode && (!variable_is_setupmode() || strcmp(variables[i], "PK") == 0)) {
+		if (!u->key_file) {
+			fprintf(stderr, "Can't update variable%s without a key\n", variable_is_setupmode() ? "" : " in User Mode");
 			exit(1);
 		}
-		buf = (char *)hash_to_esl(&guid, &len, hash);
-		st.st_size = len;
+		update_sign(u);
 	}
+}
 
-	if (esl_mode && (!variable_is_setupmode() || strcmp(variables[i], "PK") == 0)) {
-		if (!key_file) {
-			fprintf(stderr, "Can't update variable%s without a key\n", variable_is_setupmode() ? "" : " in User Mode");
-			exit(1);
+/* returns 0 or an errno */
+static int
+update_write(struct update *u)
+{
+	EFI_GUID *owner = owners[u->idx];
+
+	if (u->esl_mode)
+		return set_variable_esl(u->var, owner, u->attributes, u->len,
+					u->buf);
+	else if (u->signed_update)
+		return set_variable_headroom(u->var, owner, u->attributes,
+					     u->len, u->buf);
+	else
+		return set_variable(u->var, owner, u->attributes, u->len,
+				    u->buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *progname = argv[0], *out_file = NULL, *efivarfs = NULL;
+	struct update single, *updates = &single;
+	int i, n = 1, fd, ret, used, failed = 0;
+
+	update_init(&single);
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp("--version", argv[1]) == 0) {
+			version(progname);
+			exit(0);
+		} else if (strcmp("--help", argv[1]) == 0) {
+			help(progname);
+			exit(0);
+		} else if (strcmp(argv[1], "-p") == 0 && argc > 2) {
+			efivarfs = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp(argv[1], "-o") == 0 && argc > 2) {
+			out_file = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp(argv[1], "-M") == 0 && argc > 2) {
+			manifest = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if ((used = update_option(&single, argc, argv))) {
+			argv += used;
+			argc -= used;
+		} else {
+			/* unrecognised option */
+			break;
 		}
-		BIO *key = BIO_new_file(key_file, "r");
-		EVP_PKEY *pkey = PEM_read_bio_PrivateKey(key, NULL, NULL, NULL);
-		if (!pkey) {
-			fprintf(stderr, "error reading private key %s\n", key_file);
+	}
+
+	if (manifest) {
+		if (argc != 1 || out_file) {
+			usage(progname);
 			exit(1);
 		}
-
-		uint8_t *esl;
-		uint32_t esl_len;
-		int ret = get_variable_alloc(signedby[i], &GV_GUID, NULL,
-					     &esl_len, &esl);
-		if (ret != 0) {
-			fprintf(stderr, "Failed to get %s: ", signedby[i]);
-			perror("");
+		atexit(report_prepare_failure);
+		updates = read_manifest(&n);
+		check_manifest(updates, n);
+		/* updates of the same rank keep their manifest order */
+		qsort(updates, n, sizeof(*updates), update_cmp);
+	} else {
+		if (argc != 2) {
+			usage(progname);
 			exit(1);
 		}
-		EFI_SIGNATURE_LIST  *CertList = (EFI_SIGNATURE_LIST *)esl;
-		int DataSize = esl_len, size;
+		single.var = argv[1];
+		update_check(&single);
+	}
 
-		X509 *X = NULL;
+	if (efivarfs && (errno = kernel_variable_set_path(efivarfs))) {
+		fprintf(stderr, "Failed to open efivarfs at %s: ", efivarfs);
+		perror("");
+		exit(1);
+	}
+	kernel_variable_init();
+	ERR_load_crypto_strings();
+	OpenSSL_add_all_digests();
+	OpenSSL_add_all_ciphers();
 
-		certlist_for_each_certentry(CertList, esl, size, DataSize) {
-			EFI_SIGNATURE_DATA  *Cert;
-			if (compare_guid(&CertList->SignatureType, &X509_GUID) != 0)
-				continue;
+	/* every payload is built and signed before anything is written */
+	for (i = 0; i < n; i++) {
+		preparing = manifest ? &updates[i] : NULL;
+		update_prepare(&updates[i]);
+	}
+	preparing = NULL;
 
-			certentry_for_each_cert(Cert, CertList) {
-				const unsigned char *psig = (unsigned char *)Cert->SignatureData;
-				X = d2i_X509(NULL, &psig, CertList->SignatureSize);
-				if (X509_check_private_key(X, pkey))
-					goto out;
-				X = NULL;
+	if (!manifest) {
+		if (single.skip)
+			return 0;
+		if (out_file) {
+			fd = open(out_file, O_CREAT|O_WRONLY|O_TRUNC, S_IWUSR|S_IRUSR);
+			if (fd < 0 || write(fd, single.buf, single.len) != single.len) {
+				fprintf(stderr, "Failed to write %s: ", out_file);
+				perror("");
+				exit(1);
 			}
+			close(fd);
+			return 0;
 		}
-	out:
-		if (!X) {
-			fprintf(stderr, "No public key matching %s in %s\n", key_file, signedby[i]);
-			exit (1);
-		}
-
-		EFI_TIME timestamp;
-		time_t t;
-		struct tm *tm;
-		memset(&timestamp, 0, sizeof(timestamp));
-		time(&t);
-		tm = gmtime(&t);
-		/* FIXME: currently timestamp is one year into future because of
-		 * the way we set up the secure environment  */
-		timestamp.Year = tm->tm_year + 1900 + 1;
-		timestamp.Month = tm->tm_mon + 1;
-		timestamp.Day = tm->tm_mday;
-		timestamp.Hour = tm->tm_hour;
-		timestamp.Minute = tm->tm_min;
-		timestamp.Second = tm->tm_sec;
-
-		/* signature is over variable name (no null and uc16
-		 * chars), the vendor GUID, the attributes, the
-		 * timestamp and the contents */
-		int signbuflen = strlen(var)*2 + sizeof(EFI_GUID) + sizeof(attributes) + sizeof(timestamp) + st.st_size;
-		char *signbuf = malloc(signbuflen);
-		char *ptr = signbuf;
-		int j;
-		for (j = 0; j < strlen(var); j++) {
-			*(ptr++) = var[j]; 
-			*(ptr++) = 0;
-		}
-		memcpy(ptr, owners[i], sizeof(*owners[i]));
-		ptr += sizeof(*owners[i]);
-		memcpy(ptr, &attributes, sizeof(attributes));
-		ptr += sizeof(attributes);
-		memcpy(ptr, &timestamp, sizeof(timestamp));
-		ptr += sizeof(timestamp);
-		memcpy(ptr, buf, st.st_size);
-
-		BIO *bio = BIO_new_mem_buf(signbuf, signbuflen);
-		PKCS7 *p7 = PKCS7_sign(NULL, NULL, NULL, bio,
-				       PKCS7_BINARY | PKCS7_PARTIAL
-				       | PKCS7_DETACHED);
-		const EVP_MD *md = EVP_get_digestbyname("SHA256");
-		PKCS7_sign_add_signer(p7, X, pkey, md, PKCS7_BINARY
-				      | PKCS7_DETACHED);
-		PKCS7_final(p7, bio, PKCS7_BINARY | PKCS7_DETACHED);
-
-
-		int sigsize = i2d_PKCS7(p7, NULL);
-
-		EFI_VARIABLE_AUTHENTICATION_2 *var_auth = malloc(sizeof(EFI_VARIABLE_AUTHENTICATION_2) + sigsize);
-		var_auth->TimeStamp = timestamp;
-		var_auth->AuthInfo.CertType = EFI_CERT_TYPE_PKCS7_GUID;
-		var_auth->AuthInfo.Hdr.dwLength = sigsize + OFFSET_OF(WIN_CERTIFICATE_UEFI_GUID, CertData);
-		var_auth->AuthInfo.Hdr.wRevision = 0x0200;
-		var_auth->AuthInfo.Hdr.wCertificateType = WIN_CERT_TYPE_EFI_GUID;
-		unsigned char *tmp = var_auth->AuthInfo.CertData;
-		i2d_PKCS7(p7, &tmp);
-		ERR_print_errors_fp(stderr);
-
-		/* new update now consists of two parts: the
-		 * authentication header with the signature and the
-		 * payload (the original esl) */
-		int siglen = OFFSET_OF(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData) + sigsize;
-		char *newbuf = malloc(siglen + st.st_size);
-
-		memcpy(newbuf, var_auth, siglen);
-		memcpy(newbuf + siglen, buf, st.st_size);
-
-		free(buf);
-		free(esl);
-		free(var_auth);
-		buf = newbuf;
-		st.st_size = siglen + st.st_size;
-		esl_mode = 0;
+		ret = update_write(&single);
+		if (ret == EACCES) {
+			fprintf(stderr, "Cannot write to %s, wrong filesystem permissions\n", single.var);
+			exit(1);
+		} else if (ret != 0) {
+			errno = ret;
+			fprintf(stderr, "Failed to update %s: ", single.var);
+			perror("");
+			exit(1);
+		}
+		return 0;
 	}
 
-	if (esl_mode) {
-		ret = set_variable_esl(var, owner, attributes, st.st_size, buf);
-	} else {
-		ret = set_variable(var, owner, attributes, st.st_size, buf);
-	}
+	for (i = 0; i < n; i++) {
+		struct update *u = &updates[i];
 
-	if (ret == EACCES) {
-		fprintf(stderr, "Cannot write to %s, wrong filesystem permissions\n", var);
-		exit(1);
-	} else if (ret != 0) {
-		fprintf(stderr, "Failed to update %s: ", var);
-		perror("");
-		exit(1);
+		printf("%s:%d: %s: ", manifest, u->line, u->var);
+		if (failed) {
+			printf("not written\n");
+		} else if (u->skip) {
+			printf("nothing to do\n");
+		} else if ((ret = update_write(u)) != 0) {
+			printf("FAILED: %s\n", strerror(ret));
+			failed = 1;
+		} else {
+			printf("written, %d bytes%s\n", u->len,
+			       u->attributes & EFI_VARIABLE_APPEND_WRITE
+			       ? " appended" : "");
+		}
 	}
-
-	return 0;
+	return failed;
 }
-		
@@ -0,0 +1,636 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * A daemon that keeps the secure boot variables parsed in memory and
+ * answers queries about them over a Unix socket, so something polling
+ * them doesn't have to read and parse every certificate every time.
+ */
+
+#define _GNU_SOURCE		/* for accept4 */
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/x509.h>
+
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <kernel_efivars.h>
+#include <guid.h>
+#include <sha256.h>
+#include <esl.h>
+#include <version.h>
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+
+#define DEFAULT_SOCKET	"/run/efi-vard.sock"
+/* longest query a client may send */
+#define QUERY_MAX	64
+/* connections served at once, and how long each may take */
+#define CLIENTS_MAX	16
+#define CLIENT_TIMEOUT	2000	/* ms */
+
+/*
+ * What we last read of a variable: it is only read and parsed again
+ * once the watch says it changed or, without inotify, once the stat of
+ * its efivarfs file does.
+ */
+struct cached_var {
+	const char *name;
+	EFI_GUID *guid;
+	int esl;		/* a signature database rather than a flag */
+	int status;		/* 0, or the errno reading it gave */
+	int watch_id;
+	struct stat st;
+	unsigned long generation; /* bumped every time it changes */
+	uint32_t attributes;
+	uint32_t len;
+	uint8_t value;		/* first byte, for the flags */
+	uint8_t hash[SHA256_DIGEST_SIZE];
+	UINTN lists, entries;	/* in the valid part of a database */
+	char *json;		/* the parsed contents, as sent to clients */
+	size_t json_len;
+};
+
+static struct cached_var vars[] = {
+	{ .name = "PK", .guid = &GV_GUID, .esl = 1 },
+	{ .name = "KEK", .guid = &GV_GUID, .esl = 1 },
+	{ .name = "db", .guid = &SIG_DB, .esl = 1 },
+	{ .name = "dbx", .guid = &SIG_DB, .esl = 1 },
+	{ .name = "SecureBoot", .guid = &GV_GUID },
+	{ .name = "SetupMode", .guid = &GV_GUID },
+};
+
+static struct kernel_variable_watch *watch;
+static volatile sig_atomic_t done;
+
+static void
+usage(const char *progname)
+{
+	printf("Usage: %s: [-p <dir>] [-S <socket>]\n"
+	       "       %s: [-S <socket>] -q <query>\n", progname, progname);
+}
+
+static void
+help(const char *progname)
+{
+	usage(progname);
+	printf("Answer queries about the UEFI secure boot variables over a Unix socket\n\n"
+	       "Options:\n"
+	       "\t-p <dir>\tread the variables from the efivarfs mounted at <dir>\n"
+	       "\t-S <socket>\tlisten on (or with -q, connect to) <socket>\n"
+	       "\t\tinstead of " DEFAULT_SOCKET "\n"
+	       "\t-q <query>\tsend <query> to the daemon and print the answer;\n"
+	       "\t\t<query> is state, or one of PK, KEK, db or dbx\n"
+	       );
+}
+
+static void
+json_strn(FILE *f, const char *s, size_t len)
+{
+	size_t i;
+
+	fputc('"', f);
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void
+json_hex(FILE *f, const uint8_t *data, int len)
+{
+	int i;
+
+	fputc('"', f);
+	for (i = 0; i < len; i++)
+		fprintf(f, "%02x", data[i]);
+	fputc('"', f);
+}
+
+static void
+json_x509_name(FILE *f, const char *key, X509_NAME *name)
+{
+	BIO *bio = BIO_new(BIO_s_mem());
+	char *str;
+	long len;
+
+	fprintf(f, ",\"%s\":", key);
+	if (!bio || X509_NAME_print_ex(bio, name, 0, XN_FLAG_RFC2253) < 0) {
+		fprintf(f, "null");
+	} else {
+		len = BIO_get_mem_data(bio, &str);
+		json_strn(f, str, len);
+	}
+	BIO_free(bio);
+}
+
+static void
+json_esl(FILE *f, struct cached_var *v, uint8_t *data)
+{
+	EFI_SIGNATURE_DATA *Cert;
+	uint8_t hash[SHA256_DIGEST_SIZE];
+	sha256_context ctx;
+	esl_view view;
+	esl_list l;
+	UINTN Index;
+	int malformed;
+
+	malformed = esl_view_init(&view, data, v->len) != EFI_SUCCESS;
+	v->lists = view.lists;
+	v->entries = view.entries;
+	fprintf(f, ",\"malformed\":%s,\"lists\":[", malformed ? "true" : "false");
+	esl_view_for_each_list(&view, &l) {
+		fprintf(f, "%s{\"type\":\"%s\",\"entries\":[", l.index ? "," : "",
+			esl_type_name(l.type));
+		esl_list_for_each_entry(&l, Cert, Index) {
+			fprintf(f, "%s{\"owner\":\"%s\",\"sha256\":", Index ? "," : "",
+				guid_to_str(&Cert->SignatureOwner));
+			/* the hash itself, or a certificate's fingerprint */
+			sha256_starts(&ctx);
+			sha256_update(&ctx, Cert->SignatureData, l.data_size);
+			sha256_finish(&ctx, hash);
+			json_hex(f, hash, SHA256_DIGEST_SIZE);
+
+			if (l.type == ESL_TYPE_X509) {
+				const unsigned char *buf = Cert->SignatureData;
+				X509 *X = d2i_X509(NULL, &buf, l.data_size);
+
+				if (X) {
+					json_x509_name(f, "subject",
+						       X509_get_subject_name(X));
+					json_x509_name(f, "issuer",
+						       X509_get_issuer_name(X));
+					X509_free(X);
+				}
+			}
+			fputc('}', f);
+		}
+		fprintf(f, "]}");
+	}
+	fputc(']', f);
+}
+
+/* the fields of a variable both kinds of query give */
+static void
+json_var_summary(FILE *f, struct cached_var *v)
+{
+	fprintf(f, "{\"name\":\"%s\",\"generation\":%lu", v->name,
+		v->generation);
+	if (v->status) {
+		fprintf(f, ",\"present\":false");
+		return;
+	}
+	fprintf(f, ",\"present\":true,\"attributes\":%u,\"length\":%u,\"sha256\":",
+		v->attributes, v->len);
+	json_hex(f, v->hash, SHA256_DIGEST_SIZE);
+}
+
+static int
+same_file(struct stat *a, struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec
+		&& a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+		&& a->st_ctim.tv_sec == b->st_ctim.tv_sec
+		&& a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+static int
+changed(struct cached_var *v)
+{
+	struct stat st;
+	int status;
+
+	if (watch)
+		return kernel_variable_watch_changed(watch, v->watch_id);
+
+	status = kernel_variable_stat(v->name, v->guid, &st);
+	if (v->generation && status == v->status
+	    && (status || same_file(&st, &v->st)))
+		return 0;
+	v->st = st;
+	return 1;
+}
+
+/* read and parse v again if it changed since last time */
+static void
+refresh(struct cached_var *v)
+{
+	uint8_t *data = NULL;
+	sha256_context ctx;
+	FILE *f;
+	int status;
+
+	if (!changed(v))
+		return;
+
+	status = get_variable_alloc(v->name, v->guid, &v->attributes,
+				    &v->len, &data);
+	v->status = status;
+	v->generation++;
+	if (!status) {
+		v->value = v->len ? data[0] : 0;
+		sha256_starts(&ctx);
+		sha256_update(&ctx, data, v->len);
+		sha256_finish(&ctx, v->hash);
+	}
+
+	free(v->json);
+	v->json = NULL;
+	f = open_memstream(&v->json, &v->json_len);
+	if (!f) {
+		perror("efi-vard");
+		exit(1);
+	}
+	json_var_summary(f, v);
+	if (!status && v->esl)
+		json_esl(f, v, data);
+	fprintf(f, "}\n");
+	fclose(f);
+	free(data);
+}
+
+static struct cached_var *
+find_var(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(vars); i++)
+		if (strcmp(vars[i].name, name) == 0)
+			return &vars[i];
+	return NULL;
+}
+
+/* the answer to query, in a buffer the caller frees */
+static char *
+answer(const char *query, size_t *len)
+{
+	struct cached_var *v = find_var(query);
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, len);
+	int i;
+
+	if (!f) {
+		perror("efi-vard");
+		exit(1);
+	}
+	if (strcmp(query, "state") == 0) {
+		fputc('{', f);
+		for (i = 0; i < ARRAY_SIZE(vars); i++) {
+			v = &vars[i];
+			refresh(v);
+			fprintf(f, "%s\"%s\":", i ? "," : "", v->name);
+			if (v->esl) {
+				json_var_summary(f, v);
+				if (!v->status)
+					fprintf(f, ",\"lists\":%lu,\"entries\":%lu",
+						(unsigned long)v->lists,
+						(unsigned long)v->entries);
+				fputc('}', f);
+			} else if (v->status) {
+				fprintf(f, "null");
+			} else {
+				fprintf(f, "%u", v->value);
+			}
+		}
+		fprintf(f, "}\n");
+	} else if (v && v->esl) {
+		refresh(v);
+		fwrite(v->json, v->json_len, 1, f);
+	} else {
+		fprintf(f, "{\"error\":\"unknown query\",\"query\":");
+		json_strn(f, query, strlen(query));
+		fprintf(f, "}\n");
+	}
+	fclose(f);
+	return buf;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * One query per connection: a line of text in, the JSON answer out.
+ * Connections are non-blocking and served together from one poll()
+ * loop, so a client that is slow to send its query or to read the
+ * answer only holds up itself, and only until its deadline.
+ */
+struct client {
+	int fd;			/* -1 if the slot is free */
+	long deadline;		/* ms, on the monotonic clock */
+	char query[QUERY_MAX + 1];
+	size_t len;
+	char *answer;		/* NULL until the query is complete */
+	size_t answer_len, sent;
+};
+
+static struct client clients[CLIENTS_MAX];
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+client_close(struct client *c)
+{
+	close(c->fd);
+	free(c->answer);
+	c->fd = -1;
+	c->answer = NULL;
+}
+
+static void
+client_accept(int s)
+{
+	int i, fd;
+
+	for (i = 0; i < CLIENTS_MAX && clients[i].fd >= 0; i++)
+		;
+	if (i == CLIENTS_MAX)
+		return;
+	fd = accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN
+		    && errno != ECONNABORTED)
+			perror("accept failed");
+		return;
+	}
+	clients[i].fd = fd;
+	clients[i].deadline = now_ms() + CLIENT_TIMEOUT;
+	clients[i].len = 0;
+	clients[i].sent = 0;
+}
+
+/* read what there is of the query, and answer once it's all there */
+static void
+client_read(struct client *c)
+{
+	ssize_t ret;
+
+	ret = recv(c->fd, c->query + c->len, QUERY_MAX - c->len, 0);
+	if (ret < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			client_close(c);
+		return;
+	}
+	c->len += ret;
+	if (ret && c->len < QUERY_MAX && !memchr(c->query, '\n', c->len))
+		return;
+
+	c->query[c->len] = '\0';
+	c->query[strcspn(c->query, "\r\n")] = '\0';
+	c->answer = answer(c->query, &c->answer_len);
+}
+
+static void
+client_write(struct client *c)
+{
+	ssize_t ret;
+
+	ret = send(c->fd, c->answer + c->sent, c->answer_len - c->sent,
+		   MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			client_close(c);
+		return;
+	}
+	c->sent += ret;
+	if (c->sent == c->answer_len)
+		client_close(c);
+}
+
+static void
+serve(int s)
+{
+	struct pollfd pfd[CLIENTS_MAX + 1];
+	struct client *c, *polled[CLIENTS_MAX];
+	long now = now_ms(), timeout = -1;
+	int i, n = 0;
+
+	for (i = 0; i < CLIENTS_MAX; i++) {
+		c = &clients[i];
+		if (c->fd < 0)
+			continue;
+		/* too slow: drop it to make room for the next */
+		if (c->deadline <= now) {
+			client_close(c);
+			continue;
+		}
+		if (timeout < 0 || c->deadline - now < timeout)
+			timeout = c->deadline - now;
+		pfd[n].fd = c->fd;
+		pfd[n].events = c->answer ? POLLOUT : POLLIN;
+		polled[n++] = c;
+	}
+	/* stop taking connections while every slot is busy */
+	pfd[n].fd = s;
+	pfd[n].events = n < CLIENTS_MAX ? POLLIN : 0;
+
+	if (poll(pfd, n + 1, timeout) < 0) {
+		if (errno != EINTR) {
+			perror("poll failed");
+			done = 1;
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		c = polled[i];
+		if (pfd[i].revents & (POLLERR | POLLNVAL))
+			client_close(c);
+		else if (pfd[i].revents & (POLLIN | POLLHUP) && !c->answer)
+			client_read(c);
+		else if (pfd[i].revents & (POLLOUT | POLLHUP))
+			client_write(c);
+	}
+	if (pfd[n].revents & POLLIN)
+		client_accept(s);
+}
+
+static void
+stop(int sig)
+{
+	done = 1;
+}
+
+static void
+daemon_loop(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa;
+	int i, s;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	/* a socket left behind by a daemon that didn't exit cleanly */
+	unlink(path);
+	if (s < 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(s, 16) < 0) {
+		fprintf(stderr, "Failed to listen on %s: ", path);
+		perror("");
+		exit(1);
+	}
+	/* the variables are world readable in efivarfs too */
+	chmod(path, 0666);
+
+	/* no SA_RESTART, so a signal gets us out of poll() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	watch = kernel_variable_watch_open();
+	if (!watch)
+		perror("inotify unavailable, watching variables with stat");
+	for (i = 0; watch && i < ARRAY_SIZE(vars); i++) {
+		vars[i].watch_id = kernel_variable_watch_add(watch, vars[i].name,
+							     vars[i].guid);
+		if (vars[i].watch_id < 0) {
+			perror("efi-vard");
+			exit(1);
+		}
+	}
+
+	/* parse everything up front so the first query is as quick as any */
+	for (i = 0; i < ARRAY_SIZE(vars); i++)
+		refresh(&vars[i]);
+
+	for (i = 0; i < CLIENTS_MAX; i++)
+		clients[i].fd = -1;
+	while (!done)
+		serve(s);
+	for (i = 0; i < CLIENTS_MAX; i++)
+		if (clients[i].fd >= 0)
+			client_close(&clients[i]);
+	close(s);
+	unlink(path);
+}
+
+/* send query to the daemon at path and copy the answer to stdout */
+static int
+client(const char *path, const char *query)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char buf[4096];
+	ssize_t ret;
+	int s;
+
+	if (strlen(path) >= sizeof(addr.sun_path)
+	    || strlen(query) >= QUERY_MAX) {
+		fprintf(stderr, "socket path or query too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s < 0 || connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Failed to connect to %s: ", path);
+		perror("");
+		return 1;
+	}
+	snprintf(buf, sizeof(buf), "%s\n", query);
+	if (write_all(s, buf, strlen(buf)) < 0) {
+		perror("Failed to send query");
+		return 1;
+	}
+	while ((ret = read(s, buf, sizeof(buf))) > 0)
+		fwrite(buf, ret, 1, stdout);
+	close(s);
+	return ret < 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *progname = argv[0], *efivarfs = NULL, *query = NULL,
+		*path = DEFAULT_SOCKET;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp("--version", argv[1]) == 0) {
+			version(progname);
+			exit(0);
+		} else if (strcmp("--help", argv[1]) == 0) {
+			help(progname);
+			exit(0);
+		} else if (strcmp(argv[1], "-p") == 0 && argc > 2) {
+			efivarfs = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp(argv[1], "-S") == 0 && argc > 2) {
+			path = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp(argv[1], "-q") == 0 && argc > 2) {
+			query = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else {
+			/* unrecognised option */
+			break;
+		}
+	}
+
+	if (argc != 1 || (query && efivarfs)) {
+		usage(progname);
+		exit(1);
+	}
+
+	if (query)
+		return client(path, query);
+
+	if (efivarfs && (errno = kernel_variable_set_path(efivarfs))) {
+		fprintf(stderr, "Failed to open efivarfs at %s: ", efivarfs);
+		perror("");
+		exit(1);
+	}
+	kernel_variable_init();
+	daemon_loop(path);
+	return 0;
+}
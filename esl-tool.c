@@ -0,0 +1,251 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * Merge EFI signature lists into the smallest equivalent list: every
+ * entry appears once and all entries of the same type and size share a
+ * single EFI_SIGNATURE_LIST header.
+ */
+#include <stdint.h>
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esl.h>
+#include <version.h>
+
+struct entry {
+	EFI_SIGNATURE_LIST *list;
+	EFI_SIGNATURE_DATA *data;
+	int order;		/* position in the input, to keep the first */
+};
+
+static struct entry *entries;
+static int count, size;
+
+static void
+usage(const char *progname)
+{
+	printf("Usage: %s [-v] <efi sig list> [<efi sig list> ...] <output>\n", progname);
+}
+
+static void
+help(const char *progname)
+{
+	usage(progname);
+	printf("Merge the EFI signature lists into <output>, dropping duplicate entries\n"
+	       "and putting all entries of one type in a single list\n\n"
+	       "Options:\n"
+	       "\t-v\treport what was merged and removed\n"
+	       "The entries in each list are sorted; of duplicates, the first one\n"
+	       "given (and its owner) is kept\n"
+	       );
+}
+
+static void
+add_entry(EFI_SIGNATURE_LIST *list, EFI_SIGNATURE_DATA *data)
+{
+	if (count == size) {
+		size = size ? size * 2 : 1024;
+		entries = realloc(entries, size * sizeof(*entries));
+		if (!entries) {
+			fprintf(stderr, "failed to allocate entry table\n");
+			exit(1);
+		}
+	}
+	entries[count].list = list;
+	entries[count].data = data;
+	entries[count].order = count;
+	count++;
+}
+
+static void *
+read_file(const char *file, int *len)
+{
+	struct stat st;
+	void *buf;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Failed to read file %s: ", file);
+		perror("");
+		exit(1);
+	}
+	buf = malloc(st.st_size);
+	if (!buf) {
+		fprintf(stderr, "Malloc failed: ");
+		perror("");
+		exit(1);
+	}
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		fprintf(stderr, "Failed to read %d bytes from %s: ",
+			(int)st.st_size, file);
+		perror("");
+		exit(1);
+	}
+	close(fd);
+	*len = st.st_size;
+	return buf;
+}
+
+/* add every entry of the lists in file; returns the number of lists */
+static int
+add_file(const char *file)
+{
+	EFI_SIGNATURE_DATA *sd;
+	esl_view view;
+	esl_list l;
+	UINTN i;
+	int len;
+	void *buf = read_file(file, &len);
+
+	if (esl_view_init(&view, buf, len) != EFI_SUCCESS) {
+		fprintf(stderr, "%s: signature list %d is malformed\n",
+			file, (int)view.lists);
+		exit(1);
+	}
+	esl_view_for_each_list(&view, &l) {
+		if (l.list->SignatureHeaderSize != 0) {
+			fprintf(stderr, "%s: signature list %d has a header\n",
+				file, (int)l.index);
+			exit(1);
+		}
+		esl_list_for_each_entry(&l, sd, i)
+			add_entry(l.list, sd);
+	}
+	/* buf is referenced by the entries, so it lives until exit */
+	return view.lists;
+}
+
+/* by type, then size, then contents (not owner), then input order */
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+	int ret;
+
+	ret = memcmp(&ea->list->SignatureType, &eb->list->SignatureType,
+		     sizeof(EFI_GUID));
+	if (ret)
+		return ret;
+	if (ea->list->SignatureSize != eb->list->SignatureSize)
+		return ea->list->SignatureSize < eb->list->SignatureSize ? -1 : 1;
+	ret = memcmp(ea->data->SignatureData, eb->data->SignatureData,
+		     ea->list->SignatureSize - sizeof(EFI_GUID));
+	if (ret)
+		return ret;
+	return ea->order - eb->order;
+}
+
+static int
+same_list(struct entry *a, struct entry *b)
+{
+	return memcmp(&a->list->SignatureType, &b->list->SignatureType,
+		      sizeof(EFI_GUID)) == 0
+		&& a->list->SignatureSize == b->list->SignatureSize;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *progname = argv[0];
+	int i, j, lists = 0, verbose = 0, out_lists = 0, dups = 0;
+	size_t out_len = 0;
+	char *outfile;
+	UINT8 *out, *p;
+
+	while (argc > 1) {
+		if (strcmp("--version", argv[1]) == 0) {
+			version(progname);
+			exit(0);
+		} else if (strcmp("--help", argv[1]) == 0) {
+			help(progname);
+			exit(0);
+		} else if (strcmp("-v", argv[1]) == 0) {
+			verbose = 1;
+			argv += 1;
+			argc -= 1;
+		} else {
+			break;
+		}
+	}
+
+	if (argc < 3) {
+		usage(progname);
+		exit(1);
+	}
+	outfile = argv[argc - 1];
+
+	for (i = 1; i < argc - 1; i++)
+		lists += add_file(argv[i]);
+
+	qsort(entries, count, sizeof(*entries), entry_cmp);
+
+	/* drop duplicates, sizing the output as we go */
+	for (i = 0, j = 0; i < count; i++) {
+		if (j > 0 && same_list(&entries[j - 1], &entries[i])
+		    && memcmp(entries[j - 1].data->SignatureData,
+			      entries[i].data->SignatureData,
+			      entries[i].list->SignatureSize - sizeof(EFI_GUID)) == 0) {
+			dups++;
+			continue;
+		}
+		if (j == 0 || !same_list(&entries[j - 1], &entries[i])) {
+			out_len += sizeof(EFI_SIGNATURE_LIST);
+			out_lists++;
+		}
+		out_len += entries[i].list->SignatureSize;
+		entries[j++] = entries[i];
+	}
+	count = j;
+
+	out = malloc(out_len);
+	if (out_len && !out) {
+		fprintf(stderr, "failed to allocate %zu bytes\n", out_len);
+		exit(1);
+	}
+	for (i = 0, p = out; i < count; ) {
+		EFI_SIGNATURE_LIST *sl = (EFI_SIGNATURE_LIST *)p;
+
+		sl->SignatureType = entries[i].list->SignatureType;
+		sl->SignatureHeaderSize = 0;
+		sl->SignatureSize = entries[i].list->SignatureSize;
+		p += sizeof(*sl);
+		j = i;
+		do {
+			memcpy(p, entries[j].data, sl->SignatureSize);
+			p += sl->SignatureSize;
+		} while (++j < count && same_list(&entries[i], &entries[j]));
+		sl->SignatureListSize = sizeof(*sl) + (j - i) * sl->SignatureSize;
+		i = j;
+	}
+
+	int fd = open(outfile, O_CREAT|O_WRONLY|O_TRUNC, S_IWUSR|S_IRUSR);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s: ", outfile);
+		perror("");
+		exit(1);
+	}
+	if (write(fd, out, out_len) != out_len) {
+		fprintf(stderr, "failed to write %s: ", outfile);
+		perror("");
+		exit(1);
+	}
+	close(fd);
+
+	if (verbose)
+		printf("%d entries in %d lists merged into %d entries in %d lists, %d duplicates removed, %zu bytes\n",
+		       count + dups, lists, count, out_lists, dups, out_len);
+
+	return 0;
+}
@@ -13,20 +13,49 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
 #include <PeImage.h>		/* for ALIGN_VALUE */
 #include <sha256.h>
+#include <digest_cache.h>
+#include <esl.h>
 #include <efiauthenticated.h>
 #include <guid.h>
 #include <version.h>
 
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+
+/* binaries bigger than this are hashed from the file, not read in */
+#define STREAM_SIZE	(16 * 1024 * 1024)
+
+/* the table of binaries and their results, shared by the workers */
+static char **files;
+static int hashes;
+/* digest e of binary i is hash[i * nengines + e] */
+static UINT8 (*hash)[DIGEST_MAX_SIZE];
+static EFI_STATUS *status;
+
+/* the indices of the binaries that actually need hashing */
+static int *todo;
+static int todos;
+
+/*
+ * The digests to list, sha256 unless -a says otherwise; only sha256 on
+ * its own has the multi-buffer code and the cache
+ */
+static const digest_engine *engines[4];
+static int nengines;
+
+static int next_file;
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 usage(const char *progname)
 {
-	printf("Usage: %s efi-binary [efi-binary ...] efi-signature-list\n", progname);
+	printf("Usage: %s [-a <alg> ...] [-j <jobs>] [-l <list>] [-C <cache>] [-x <dbx>] efi-binary [efi-binary ...] efi-signature-list\n", progname);
 }
 
 static void
@@ -36,16 +65,259 @@ help(const char *progname)
 	printf("Produce an EFI Signature List file containing the sha256 hash of the\n"
 	       "passed in EFI binary\n"
 	       "\nOptions:\n"
-	       "none\n"
+	       "\t-a <alg>\tlist the sha1, sha256 (the default), sha384 or\n"
+	       "\t\t\tsha512 Authenticode digest instead; given more than\n"
+	       "\t\t\tonce, every one is listed, each in its own list\n"
+	       "\t-j <jobs>\thash with <jobs> threads in parallel\n"
+	       "\t-l <list>\tread the names of further binaries, one per line,\n"
+	       "\t\t\tfrom <list> (- for stdin)\n"
+	       "\t-C <cache>\tkeep the digests in <cache> and reuse them for\n"
+	       "\t\t\tbinaries that haven't changed since they were hashed\n"
+	       "\t-x <dbx>\twarn about binaries whose hash is in the signature\n"
+	       "\t\t\tlist <dbx>.  With -C, a filter of <dbx> is kept in\n"
+	       "\t\t\t<cache>.dbx so unchanged lists needn't be parsed again\n"
+	       "The hashes are placed in the list in the order the binaries are given\n"
 	       );
 }
 
+static void
+add_file(char *name)
+{
+	static int size;
+
+	if (hashes == size) {
+		size = size ? size * 2 : 64;
+		files = realloc(files, size * sizeof(*files));
+		if (!files) {
+			fprintf(stderr, "failed to allocate file list\n");
+			exit(1);
+		}
+	}
+	files[hashes++] = name;
+}
+
+static void
+read_file_list(const char *list)
+{
+	FILE *f = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+
+	if (!f) {
+		fprintf(stderr, "failed to open file %s: ", list);
+		perror("");
+		exit(1);
+	}
+	while ((len = getline(&line, &n, f)) != -1) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len)
+			add_file(strdup(line));
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+}
+
+/* read and hash binaries todo[first] .. todo[first + batch - 1].  The small ones
+ * are read in and hashed together by the multi-buffer sha256 code,
+ * big ones are hashed straight from the file instead of being read in
+ * whole */
+static void
+hash_batch(int first, int batch)
+{
+	int i, j, loaded = 0;
+	void *efifile, *efifiles[SHA256_MB_LANES];
+	UINTN sizes[SHA256_MB_LANES];
+	int index[SHA256_MB_LANES];
+	EFI_STATUS mstatus[SHA256_MB_LANES];
+	UINT8 mhash[SHA256_MB_LANES][SHA256_DIGEST_SIZE];
+
+	for (i = first; i < first + batch; i++) {
+		int file = todo[i];
+		struct stat st;
+		size_t len;
+		int fdefifile = open(files[file], O_RDONLY);
+		if (fdefifile == -1) {
+			fprintf(stderr, "failed to open file %s: ", files[file]);
+			perror("");
+			exit(1);
+		}
+		if (fstat(fdefifile, &st) < 0) {
+			fprintf(stderr, "failed to stat file %s: ", files[file]);
+			perror("");
+			exit(1);
+		}
+		if (nengines > 1 || engines[0] != &evp_sha256_engine) {
+			UINT8 *digest[ARRAY_SIZE(engines)];
+			int e;
+
+			/* every digest in one pass over the binary */
+			for (e = 0; e < nengines; e++)
+				digest[e] = hash[file * nengines + e];
+			status[file] = pecoff_digests_fd(engines, nengines,
+							 fdefifile, digest);
+			close(fdefifile);
+			continue;
+		}
+		if (st.st_size > STREAM_SIZE) {
+			status[file] = sha256_get_pecoff_digest_fd(fdefifile,
+								   hash[file]);
+			close(fdefifile);
+			continue;
+		}
+		len = ALIGN_VALUE(st.st_size, 4096);
+		efifile = malloc(len ? len : 1);
+		if (!efifile) {
+			fprintf(stderr, "failed to allocate memory for file %s\n",
+				files[file]);
+			exit(1);
+		}
+		memset(efifile, 0, len);
+		if (read(fdefifile, efifile, st.st_size) != st.st_size) {
+			fprintf(stderr, "failed to read file %s: ", files[file]);
+			perror("");
+			exit(1);
+		}
+		close(fdefifile);
+		efifiles[loaded] = efifile;
+		sizes[loaded] = st.st_size;
+		index[loaded++] = file;
+	}
+
+	sha256_get_pecoff_digest_mem_multi(efifiles, sizes, mhash,
+					   mstatus, loaded);
+
+	for (j = 0; j < loaded; j++) {
+		free(efifiles[j]);
+		status[index[j]] = mstatus[j];
+		memcpy(hash[index[j]], mhash[j], SHA256_DIGEST_SIZE);
+	}
+}
+
+static void *
+hash_worker(void *arg)
+{
+	for (;;) {
+		int first, batch;
+
+		pthread_mutex_lock(&next_lock);
+		first = next_file;
+		batch = todos - first;
+		if (batch > SHA256_MB_LANES)
+			batch = SHA256_MB_LANES;
+		next_file += batch;
+		pthread_mutex_unlock(&next_lock);
+
+		if (batch <= 0)
+			return NULL;
+		hash_batch(first, batch);
+	}
+}
+
+/* the signature list type of a digest */
+static EFI_GUID *
+engine_guid(const digest_engine *e)
+{
+	if (e == &evp_sha1_engine)
+		return &EFI_CERT_SHA1_GUID;
+	if (e == &evp_sha384_engine)
+		return &EFI_CERT_SHA384_GUID;
+	if (e == &evp_sha512_engine)
+		return &EFI_CERT_SHA512_GUID;
+	return &EFI_CERT_SHA256_GUID;
+}
+
+static UINT8 *
+read_esl(const char *name, UINTN *len)
+{
+	int fd = open(name, O_RDONLY);
+	struct stat st;
+	UINT8 *buf;
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "failed to read file %s: ", name);
+		perror("");
+		exit(1);
+	}
+	buf = malloc(st.st_size);
+	if (!buf || read(fd, buf, st.st_size) != st.st_size) {
+		fprintf(stderr, "failed to read file %s\n", name);
+		exit(1);
+	}
+	close(fd);
+	*len = st.st_size;
+	return buf;
+}
+
+/*
+ * Warn about any hash that is in the signature list dbxfile.  Almost
+ * none are, so only the Bloom filter is consulted first; with a cache,
+ * the filter comes from there and the list is only read to confirm a
+ * possible hit.
+ */
+static void
+check_revoked(const char *dbxfile, const char *cachefile)
+{
+	char *bloomfile = NULL;
+	esl_bloom bloom;
+	struct stat st;
+	UINT8 *dbx = NULL;
+	UINTN dbx_len;
+	int i;
+
+	if (stat(dbxfile, &st) < 0) {
+		fprintf(stderr, "failed to read file %s: ", dbxfile);
+		perror("");
+		exit(1);
+	}
+	if (cachefile) {
+		bloomfile = malloc(strlen(cachefile) + sizeof(".dbx"));
+		if (!bloomfile) {
+			fprintf(stderr, "failed to allocate file name\n");
+			exit(1);
+		}
+		sprintf(bloomfile, "%s.dbx", cachefile);
+	}
+	if (!bloomfile || !digest_cache_bloom_load(bloomfile, &st,
+						   SHA256_DIGEST_SIZE, &bloom)) {
+		dbx = read_esl(dbxfile, &dbx_len);
+		if (esl_bloom_build(&bloom, dbx, dbx_len, SHA256_DIGEST_SIZE)
+		    != EFI_SUCCESS) {
+			fprintf(stderr, "failed to build filter of %s\n",
+				dbxfile);
+			exit(1);
+		}
+		if (bloomfile)
+			digest_cache_bloom_save(bloomfile, &st, &bloom);
+	}
+
+	for (i = 0; i < hashes; i++) {
+		if (status[i] != EFI_SUCCESS
+		    || esl_bloom_find(&bloom, hash[i]) != EFI_SUCCESS)
+			continue;
+		if (!dbx)
+			dbx = read_esl(dbxfile, &dbx_len);
+		if (find_in_esl(dbx, dbx_len, hash[i], SHA256_DIGEST_SIZE)
+		    == EFI_SUCCESS)
+			fprintf(stderr, "%s is revoked by %s\n", files[i],
+				dbxfile);
+	}
+
+	esl_bloom_free(&bloom);
+	free(dbx);
+	free(bloomfile);
+}
+
 int
 main(int argc, char *argv[])
 {
-	void *efifile;
 	const char *progname = argv[0];
-	int i;
+	char *outfile, *list = NULL, *cachefile = NULL, *dbxfile = NULL;
+	struct digest_cache *cache = NULL;
+	struct stat *st = NULL;
+	int i, jobs = 1;
 
 	while (argc > 1) {
 		if (strcmp("--version", argv[1]) == 0) {
@@ -54,71 +326,172 @@ main(int argc, char *argv[])
 		} else if (strcmp("--help", argv[1]) == 0) {
 			help(progname);
 			exit(0);
+		} else if (strcmp("-a", argv[1]) == 0 && argc > 2) {
+			const digest_engine *engine = digest_engine_by_name(argv[2]);
+
+			if (!engine) {
+				fprintf(stderr, "unknown digest %s\n", argv[2]);
+				exit(1);
+			}
+			for (i = 0; i < nengines; i++)
+				if (engines[i] == engine)
+					break;
+			if (i == nengines)
+				engines[nengines++] = engine;
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-j", argv[1]) == 0 && argc > 2) {
+			jobs = atoi(argv[2]);
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-l", argv[1]) == 0 && argc > 2) {
+			list = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-C", argv[1]) == 0 && argc > 2) {
+			cachefile = argv[2];
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-x", argv[1]) == 0 && argc > 2) {
+			dbxfile = argv[2];
+			argv += 2;
+			argc -= 2;
 		} else  {
 			break;
 		}
 	}
 
-	if (argc < 3) {
+	if (argc < (list ? 2 : 3) || jobs < 1) {
 		usage(progname);
 		exit(1);
 	}
+	if (!nengines)
+		engines[nengines++] = &evp_sha256_engine;
+	if ((nengines > 1 || engines[0] != &evp_sha256_engine)
+	    && (cachefile || dbxfile)) {
+		fprintf(stderr, "-C and -x only work with sha256 digests\n");
+		exit(1);
+	}
 
-	int hashes = argc - 2;
-	UINT8 hash[hashes][SHA256_DIGEST_SIZE];
-
-	memset(hash, 0, sizeof(hash));
+	for (i = 1; i < argc - 1; i++)
+		add_file(argv[i]);
+	if (list)
+		read_file_list(list);
+	outfile = argv[argc - 1];
 
-	for (i = 0; i < hashes; i++) {
-		int j;
-		struct stat st;
-		EFI_STATUS status;
+	hash = calloc(hashes * nengines, sizeof(*hash));
+	status = calloc(hashes, sizeof(*status));
+	todo = malloc(hashes * sizeof(*todo));
+	if (hashes && (!hash || !status || !todo)) {
+		fprintf(stderr, "failed to allocate %d hashes\n", hashes);
+		exit(1);
+	}
 
-		int fdefifile = open(argv[i + 1], O_RDONLY);
-		if (fdefifile == -1) {
-			fprintf(stderr, "failed to open file %s: ", argv[1]);
+	if (cachefile) {
+		cache = digest_cache_open(cachefile);
+		st = malloc(hashes * sizeof(*st));
+		if (!cache || (hashes && !st)) {
+			fprintf(stderr, "failed to open digest cache %s: ",
+				cachefile);
 			perror("");
 			exit(1);
 		}
-		fstat(fdefifile, &st);
-		efifile = malloc(ALIGN_VALUE(st.st_size, 4096));
-		memset(efifile, 0, ALIGN_VALUE(st.st_size, 4096));
-		read(fdefifile, efifile, st.st_size);
-		close(fdefifile);
-		status = sha256_get_pecoff_digest_mem(efifile, st.st_size,
-						      hash[i]);
-		if (status != EFI_SUCCESS) {
-			printf("Failed to get hash of %s: %d\n", argv[i+1],
-			       status);
+	}
+	for (i = 0; i < hashes; i++) {
+		if (cache && stat(files[i], &st[i]) == 0
+		    && digest_cache_lookup(cache, &st[i], hash[i])) {
+			status[i] = EFI_SUCCESS;
 			continue;
 		}
-		printf("HASH IS ");
-		for (j = 0; j < SHA256_DIGEST_SIZE; j++) {
-			printf("%02x", hash[i][j]);
+		todo[todos++] = i;
+	}
+
+	if (jobs > (todos + SHA256_MB_LANES - 1) / SHA256_MB_LANES)
+		jobs = (todos + SHA256_MB_LANES - 1) / SHA256_MB_LANES;
+	if (jobs <= 1) {
+		hash_worker(NULL);
+	} else {
+		pthread_t *workers = malloc(jobs * sizeof(*workers));
+
+		for (i = 0; i < jobs; i++) {
+			if (pthread_create(&workers[i], NULL, hash_worker, NULL)) {
+				fprintf(stderr, "failed to start worker %d\n", i);
+				exit(1);
+			}
 		}
-		printf("\n");
+		for (i = 0; i < jobs; i++)
+			pthread_join(workers[i], NULL);
+		free(workers);
 	}
-	UINT8 sig[sizeof(EFI_SIGNATURE_LIST) + (sizeof(EFI_SIGNATURE_DATA) - 1 + SHA256_DIGEST_SIZE) * hashes];
 
-	EFI_SIGNATURE_LIST *l = (void *)sig;
+	if (cache) {
+		/* keyed on the stat taken before hashing, so a binary
+		 * rewritten meanwhile simply never matches its entry */
+		for (i = 0; i < todos; i++)
+			if (status[todo[i]] == EFI_SUCCESS)
+				digest_cache_insert(cache, &st[todo[i]],
+						    hash[todo[i]]);
+		digest_cache_close(cache);
+		free(st);
+	}
 
-	memset(sig, 0, sizeof(sig));
-	l->SignatureType = EFI_CERT_SHA256_GUID;
-	l->SignatureListSize = sizeof(sig);
-	l->SignatureSize = 16 +32; /* UEFI defined */
 	for (i = 0; i < hashes; i++) {
-		EFI_SIGNATURE_DATA *d = (void *)sig + sizeof(EFI_SIGNATURE_LIST) + l->SignatureSize * i;
-		d->SignatureOwner = MOK_OWNER;
-		memcpy(&d->SignatureData, hash[i], sizeof(hash[i]));
+		int e, k;
+
+		if (status[i] != EFI_SUCCESS) {
+			printf("Failed to get hash of %s: %d\n", files[i],
+			       (int)status[i]);
+			continue;
+		}
+		for (e = 0; e < nengines; e++) {
+			if (nengines > 1)
+				printf("%s ", engines[e]->name);
+			printf("HASH IS ");
+			for (k = 0; k < engines[e]->size; k++) {
+				printf("%02x", hash[i * nengines + e][k]);
+			}
+			printf("\n");
+		}
+	}
+
+	if (dbxfile)
+		check_revoked(dbxfile, cachefile);
+
+	/* one list per digest, in the order -a gave them */
+	int e, siglen = 0;
+
+	for (e = 0; e < nengines; e++)
+		siglen += sizeof(EFI_SIGNATURE_LIST) + (sizeof(EFI_SIGNATURE_DATA) - 1 + engines[e]->size) * hashes;
+	UINT8 *sig = calloc(1, siglen), *ptr = sig;
+
+	if (!sig) {
+		fprintf(stderr, "failed to allocate signature list\n");
+		exit(1);
+	}
+
+	for (e = 0; e < nengines; e++) {
+		EFI_SIGNATURE_LIST *l = (void *)ptr;
+
+		l->SignatureType = *engine_guid(engines[e]);
+		l->SignatureSize = 16 + engines[e]->size; /* UEFI defined */
+		l->SignatureListSize = sizeof(EFI_SIGNATURE_LIST) + l->SignatureSize * hashes;
+		for (i = 0; i < hashes; i++) {
+			EFI_SIGNATURE_DATA *d = (void *)ptr + sizeof(EFI_SIGNATURE_LIST) + l->SignatureSize * i;
+			d->SignatureOwner = MOK_OWNER;
+			memcpy(&d->SignatureData, hash[i * nengines + e],
+			       engines[e]->size);
+		}
+		ptr += l->SignatureListSize;
 	}
 
-	int fdoutfile = open(argv[hashes + 1], O_CREAT|O_WRONLY|O_TRUNC, S_IWUSR|S_IRUSR);
+	int fdoutfile = open(outfile, O_CREAT|O_WRONLY|O_TRUNC, S_IWUSR|S_IRUSR);
 	if (fdoutfile == -1) {
-		fprintf(stderr, "failed to open %s: ", argv[hashes + 1]);
+		fprintf(stderr, "failed to open %s: ", outfile);
 		perror("");
 		exit(1);
 	}
-	write(fdoutfile, sig, sizeof(sig));
+	write(fdoutfile, sig, siglen);
 	close(fdoutfile);
+	free(sig);
 	return 0;
 }
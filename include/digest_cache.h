@@ -0,0 +1,27 @@
+#ifndef _DIGEST_CACHE_H
+#define _DIGEST_CACHE_H
+
+#include <sys/stat.h>
+
+#include <sha256.h>
+#include <esl.h>
+
+struct digest_cache;
+
+struct digest_cache *
+digest_cache_open(const char *path);
+void
+digest_cache_close(struct digest_cache *dc);
+int
+digest_cache_lookup(struct digest_cache *dc, struct stat *st,
+		    uint8_t hash[SHA256_DIGEST_SIZE]);
+int
+digest_cache_insert(struct digest_cache *dc, struct stat *st,
+		    uint8_t hash[SHA256_DIGEST_SIZE]);
+int
+digest_cache_bloom_load(const char *path, struct stat *st, size_t keylen,
+			esl_bloom *bloom);
+int
+digest_cache_bloom_save(const char *path, struct stat *st, esl_bloom *bloom);
+
+#endif /* _DIGEST_CACHE_H */
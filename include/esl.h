@@ -0,0 +1,97 @@
+#ifndef _ESL_H
+#define _ESL_H
+
+#include <efiauthenticated.h>
+
+/*
+ * A validated view of a signature list blob.  The view borrows the
+ * buffer (which may be mmap'd) and never copies it; esl_view_init()
+ * checks every list header once, so walking the view afterwards needs
+ * no further bounds checks.
+ */
+typedef enum {
+	ESL_TYPE_UNKNOWN,
+	ESL_TYPE_X509,
+	ESL_TYPE_RSA2048,
+	ESL_TYPE_PKCS7,
+	ESL_TYPE_SHA256,
+} esl_type;
+
+typedef struct {
+	UINT8 *data;
+	UINTN size;		/* bytes of valid lists in data */
+	UINTN lists;
+	UINTN entries;
+} esl_view;
+
+typedef struct {
+	EFI_SIGNATURE_LIST *list;	/* NULL before the first list */
+	UINTN index;			/* of the list in the view */
+	esl_type type;
+	UINT8 *entry;			/* the first EFI_SIGNATURE_DATA */
+	UINTN count;			/* entries in the list */
+	UINTN entry_size;		/* SignatureSize */
+	UINTN data_size;		/* bytes of SignatureData per entry */
+} esl_list;
+
+EFI_STATUS
+esl_view_init(esl_view *view, void *Data, UINTN DataSize);
+BOOLEAN
+esl_view_next(esl_view *view, esl_list *list);
+EFI_STATUS
+esl_view_list(esl_view *view, UINTN index, esl_list *list);
+esl_type
+esl_type_from_guid(EFI_GUID *guid);
+const char *
+esl_type_name(esl_type type);
+
+#define esl_view_for_each_list(view, l)				\
+	for ((l)->list = NULL; esl_view_next(view, l); )
+
+static inline EFI_SIGNATURE_DATA *
+esl_list_entry(esl_list *list, UINTN index)
+{
+	if (index >= list->count)
+		return NULL;
+	return (EFI_SIGNATURE_DATA *)(list->entry + index * list->entry_size);
+}
+
+#define esl_list_for_each_entry(l, sd, i)				\
+	for ((i) = 0; ((sd) = esl_list_entry(l, i)) != NULL; (i)++)
+
+EFI_STATUS
+find_in_esl(UINT8 *Data, UINTN DataSize, UINT8 *key, UINTN keylen);
+
+/* hash table of the keylen sized entries of a signature list blob */
+typedef struct {
+	UINTN keylen;
+	UINTN count;
+	UINTN mask;
+	UINT8 *keys;		/* count keys of keylen bytes */
+	UINTN *slots;		/* key number + 1, or zero if empty */
+} esl_index;
+
+EFI_STATUS
+esl_index_build(esl_index *idx, UINT8 *Data, UINTN DataSize, UINTN keylen);
+EFI_STATUS
+esl_index_find(esl_index *idx, UINT8 *key);
+void
+esl_index_free(esl_index *idx);
+
+/* Bloom filter of the same, to rule keys out in one cache line */
+#define ESL_BLOOM_BLOCK_WORDS	8	/* UINT64s in a 64 byte block */
+
+typedef struct {
+	UINTN keylen;
+	UINTN blocks;		/* a power of two */
+	UINT64 *bits;		/* blocks * ESL_BLOOM_BLOCK_WORDS */
+} esl_bloom;
+
+EFI_STATUS
+esl_bloom_build(esl_bloom *bloom, UINT8 *Data, UINTN DataSize, UINTN keylen);
+EFI_STATUS
+esl_bloom_find(esl_bloom *bloom, UINT8 *key);
+void
+esl_bloom_free(esl_bloom *bloom);
+
+#endif /* _ESL_H */
@@ -3,9 +3,50 @@
 void
 kernel_variable_init(void);
 int
+kernel_variable_set_path(const char *path);
+int
 get_variable(const char *var, EFI_GUID *guid, uint32_t *attributes,
 	     uint32_t *size, void *buf);
 int
+get_variable_buf(const char *var, EFI_GUID *guid, uint32_t *attributes,
+		 uint32_t *size, uint8_t **buf, uint32_t *bufsize);
+struct stat;
+int
+kernel_variable_stat(const char *var, EFI_GUID *guid, struct stat *st);
+typedef int (*kernel_variable_fn)(const char *var, EFI_GUID *guid,
+				  uint32_t attributes, uint32_t size,
+				  uint8_t *data, void *arg);
+/* one variable of a kernel_variable_read_batch() */
+struct kernel_variable_req {
+	const char *var;	/* in */
+	EFI_GUID guid;		/* in */
+	int status;		/* 0 or an errno */
+	uint32_t attributes;
+	uint32_t size;
+	uint8_t *data;
+};
+int
+kernel_variable_read_batch(struct kernel_variable_req *req, int n);
+void
+kernel_variable_batch_free(struct kernel_variable_req *req, int n);
+int
+kernel_variable_for_each(kernel_variable_fn fn, void *arg);
+/* change notification for cached variables, see kernel_efivars.c */
+struct kernel_variable_watch;
+struct kernel_variable_watch *
+kernel_variable_watch_open(void);
+void
+kernel_variable_watch_close(struct kernel_variable_watch *w);
+int
+kernel_variable_watch_add(struct kernel_variable_watch *w, const char *var,
+			  EFI_GUID *guid);
+int
+kernel_variable_watch_fd(struct kernel_variable_watch *w);
+int
+kernel_variable_watch_read(struct kernel_variable_watch *w);
+int
+kernel_variable_watch_changed(struct kernel_variable_watch *w, int id);
+int
 get_variable_alloc(const char *var, EFI_GUID *guid, uint32_t *attributes,
 		   uint32_t *size, uint8_t **buf);
 int
@@ -15,6 +56,11 @@ variable_is_secureboot(void);
 int
 set_variable(const char *var, EFI_GUID *guid, uint32_t attributes,
 	     uint32_t size, void *buf);
+/* bytes set_variable_headroom() needs free in front of the data */
+#define KERNEL_VARIABLE_HEADROOM	sizeof(uint32_t)
+int
+set_variable_headroom(const char *var, EFI_GUID *guid, uint32_t attributes,
+		      uint32_t size, void *buf);
 int
 set_variable_esl(const char *var, EFI_GUID *guid, uint32_t attributes,
 		 uint32_t size, void *buf);
@@ -24,3 +70,19 @@ set_variable_hash(const char *var, EFI_GUID *owner, uint32_t attributes,
 uint8_t *
 hash_to_esl(EFI_GUID *owner, int *len,
 	    uint8_t hash[SHA256_DIGEST_SIZE]);
+
+/*
+ * A snapshot archive of the whole variable store, as written by
+ * efi-readvar -a: the magic, then for every variable a record header
+ * followed by name_len bytes of name (no terminator) and data_len bytes
+ * of data, and finally a record with name_len zero.  All the fields are
+ * little endian.
+ */
+#define EFIVARS_ARCHIVE_MAGIC	"EFIVARS1"
+
+struct efivars_archive_record {
+	uint32_t name_len;
+	EFI_GUID guid;
+	uint32_t attributes;
+	uint32_t data_len;
+} __attribute__((packed));
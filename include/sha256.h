@@ -6,10 +6,15 @@
 #endif
 
 #ifndef uint32
-#define uint32 unsigned long int
+#define uint32 unsigned int
 #endif
 
 #define SHA256_DIGEST_SIZE 32
+/* the largest digest any digest_engine produces (sha512) */
+#define DIGEST_MAX_SIZE 64
+
+/* contexts that sha256_update_multi() may compress together */
+#define SHA256_MB_LANES 8
 
 typedef struct
 {
@@ -22,9 +27,63 @@ sha256_context;
 void sha256_starts( sha256_context *ctx );
 void sha256_update( sha256_context *ctx, uint8 *input, uint32 length );
 void sha256_finish( sha256_context *ctx, uint8 digest[32] );
+void sha256_update_multi( sha256_context *ctx[], uint8 *input[],
+                          uint32 length[], int n );
+
+typedef struct {
+	UINTN offset;
+	UINTN size;
+} sha256_range;
+
+EFI_STATUS
+sha256_pecoff_ranges(void *buffer, UINTN DataSize, sha256_range **ranges,
+		     int *count);
+
+/*
+ * A hash algorithm the Authenticode code can run.  init() returns a
+ * fresh context (NULL if out of memory) and final() writes size bytes
+ * of digest and frees it.
+ */
+typedef struct digest_engine {
+	const char *name;
+	UINTN size;
+	void *(*init)(const struct digest_engine *engine);
+	void (*update)(void *ctx, void *data, UINTN len);
+	void (*final)(void *ctx, UINT8 *digest);
+} digest_engine;
+
+/* the sha256 above, always available */
+extern const digest_engine sha256_engine;
+#ifndef BUILD_EFI
+/* OpenSSL's digests (lib/digest_evp.c), the userspace default */
+extern const digest_engine evp_sha1_engine, evp_sha256_engine,
+	evp_sha384_engine, evp_sha512_engine;
+const digest_engine *
+digest_engine_by_name(const char *name);
+#endif
+
+EFI_STATUS
+pecoff_digest_mem(const digest_engine *engine, void *buffer, UINTN DataSize,
+		  UINT8 *hash);
+EFI_STATUS
+pecoff_digests_mem(const digest_engine *engine[], int n, void *buffer,
+		   UINTN DataSize, UINT8 *hash[]);
 EFI_STATUS
 sha256_get_pecoff_digest_mem(void *buffer, UINTN DataSize,
 			     UINT8 hash[SHA256_DIGEST_SIZE]);
+EFI_STATUS
+sha256_get_pecoff_digest_mem_multi(void *buffer[], UINTN DataSize[],
+				   UINT8 hash[][SHA256_DIGEST_SIZE],
+				   EFI_STATUS status[], int n);
+#ifndef BUILD_EFI
+EFI_STATUS
+pecoff_digest_fd(const digest_engine *engine, int fd, UINT8 *hash);
+EFI_STATUS
+pecoff_digests_fd(const digest_engine *engine[], int n, int fd,
+		  UINT8 *hash[]);
+EFI_STATUS
+sha256_get_pecoff_digest_fd(int fd, UINT8 hash[SHA256_DIGEST_SIZE]);
+#endif
 void
 sha256_StrCat_hash(CHAR16 *str, UINT8 hash[SHA256_DIGEST_SIZE]);
 EFI_STATUS
@@ -3,6 +3,8 @@ simple_file_open (EFI_HANDLE image, CHAR16 *name, EFI_FILE **file, UINT64 mode);
 EFI_STATUS
 simple_file_open_by_handle(EFI_HANDLE device, CHAR16 *name, EFI_FILE **file, UINT64 mode);
 EFI_STATUS
+simple_file_size(EFI_FILE *file, UINTN *size);
+EFI_STATUS
 simple_file_read_all(EFI_FILE *file, UINTN *size, void **buffer);
 EFI_STATUS
 simple_file_write_all(EFI_FILE *file, UINTN size, void *buffer);
@@ -0,0 +1,23 @@
+#ifndef _SYNTH_H
+#define _SYNTH_H
+
+/*
+ * Reproducible synthetic inputs for benchmarking and stress testing.
+ * Everything is generated from a single seeded stream, so the same seed
+ * and the same calls give the same bytes.
+ */
+void
+synth_seed(UINT64 seed);
+UINT64
+synth_random(void);
+void
+synth_fill(void *buf, UINTN len);
+void *
+synth_pe_image(UINTN size, int nsec, int relocs, UINTN *len, UINTN *nrelocs);
+void *
+synth_sha256_esl(int n, EFI_GUID *owner, UINTN *len);
+void *
+synth_x509_esl(int n, void *cert, UINTN certlen, UINTN serial,
+	       UINTN serial_len, EFI_GUID *owner, UINTN *len);
+
+#endif /* _SYNTH_H */
@@ -1,3 +1,8 @@
+/*
+ * Unchecked walkers over a signature list blob, for code that edits the
+ * blob in place.  Code that only reads lists should use the validated
+ * esl_view in esl.h instead.
+ */
 
 #define certlist_for_each_certentry(cl, cl_init, s, s_init)		\
 	for (cl = (EFI_SIGNATURE_LIST *)(cl_init), s = (s_init);	\
@@ -0,0 +1,24 @@
+#ifndef _VARSIGN_H
+#define _VARSIGN_H
+
+#include <openssl/x509.h>
+
+/*
+ * Signing of authenticated variable updates, shared by the userspace
+ * tools.  Everything returned is malloc'd; NULL means out of memory or
+ * an OpenSSL failure, whose errors are left on the OpenSSL error queue.
+ */
+void *
+variable_sign_bundle(const char *var, EFI_GUID *vendor, UINT32 attributes,
+		     EFI_TIME *timestamp, void *data, UINTN datalen,
+		     UINTN *len);
+unsigned char *
+variable_sign_pkcs7(void *bundle, UINTN len, X509 *cert, EVP_PKEY *pkey,
+		    int flags, int *sigsize);
+void *
+variable_sign_update(const char *var, EFI_GUID *vendor, UINT32 attributes,
+		     EFI_TIME *timestamp, void *data, UINTN datalen,
+		     X509 *cert, EVP_PKEY *pkey, int flags, UINTN headroom,
+		     UINTN *len);
+
+#endif /* _VARSIGN_H */
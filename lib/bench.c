@@ -0,0 +1,350 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * Microbenchmarks for the hot paths in this library, run by "make bench".
+ * Every measurement is one CSV line on stdout:
+ *
+ *	benchmark,variant,size,iterations,seconds,rate,unit
+ *
+ * where size is the input in bytes (entries for the ESL lookups) and
+ * rate is the throughput in unit.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <pecoff.h>
+#include <sha256.h>
+#include <guid.h>
+#include <variables.h>
+#include <synth.h>
+#include <version.h>
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+
+/* how long each measurement runs for at least, in seconds */
+static double min_time = 0.5;
+static UINTN max_image = 256 * 1024 * 1024;
+static int max_entries = 1024 * 1024;
+
+static void
+usage(const char *progname)
+{
+	printf("Usage: %s [-t <seconds>] [-m <bytes>] [-n <entries>]\n", progname);
+}
+
+static void
+help(const char *progname)
+{
+	usage(progname);
+	printf("Benchmark the sha256, PE digest, signature list and relocation code\n"
+	       "and print the results as CSV\n\n"
+	       "Options:\n"
+	       "\t-t <seconds>\trun each measurement for at least <seconds>\n"
+	       "\t-m <bytes>\tlargest PE image to generate\n"
+	       "\t-n <entries>\tlargest signature list to generate\n"
+	       );
+}
+
+static void *
+bench_alloc(UINTN len)
+{
+	void *buf = calloc(1, len);
+
+	if (!buf) {
+		fprintf(stderr, "failed to allocate %lu bytes\n",
+			(unsigned long)len);
+		exit(1);
+	}
+	return buf;
+}
+
+static void *
+bench_generated(void *data)
+{
+	if (!data) {
+		fprintf(stderr, "failed to generate benchmark input\n");
+		exit(1);
+	}
+	return data;
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run fn(arg) until min_time has passed and report it; work is what one
+ * call gets through, in unit (MB are 10^6 bytes)
+ */
+static void
+bench_run(const char *benchmark, const char *variant, UINTN size,
+	  void (*fn)(void *), void *arg, double work, const char *unit)
+{
+	double start, elapsed;
+	long iterations = 0;
+
+	fn(arg);		/* warm up caches and the dispatch */
+	start = bench_now();
+	do {
+		fn(arg);
+		iterations++;
+		elapsed = bench_now() - start;
+	} while (elapsed < min_time);
+
+	printf("%s,%s,%lu,%ld,%.6f,%.2f,%s\n", benchmark, variant,
+	       (unsigned long)size, iterations, elapsed,
+	       work * iterations / elapsed, unit);
+	fflush(stdout);
+}
+
+struct bench_buffer {
+	void *data;
+	UINTN len;
+	void *key;
+};
+
+static void
+bench_sha256_update(void *arg)
+{
+	struct bench_buffer *b = arg;
+	sha256_context ctx;
+	UINT8 hash[SHA256_DIGEST_SIZE];
+
+	sha256_starts(&ctx);
+	sha256_update(&ctx, b->data, b->len);
+	sha256_finish(&ctx, hash);
+}
+
+static void
+bench_digest_embedded(void *arg)
+{
+	struct bench_buffer *b = arg;
+	UINT8 hash[SHA256_DIGEST_SIZE];
+
+	pecoff_digest_mem(&sha256_engine, b->data, b->len, hash);
+}
+
+static void
+bench_digest_evp(void *arg)
+{
+	struct bench_buffer *b = arg;
+	UINT8 hash[SHA256_DIGEST_SIZE];
+
+	pecoff_digest_mem(&evp_sha256_engine, b->data, b->len, hash);
+}
+
+/* the same image SHA256_MB_LANES times over, as a batch does */
+static void
+bench_digest_multi(void *arg)
+{
+	struct bench_buffer *b = arg;
+	void *buffer[SHA256_MB_LANES];
+	UINTN size[SHA256_MB_LANES];
+	UINT8 hash[SHA256_MB_LANES][SHA256_DIGEST_SIZE];
+	int i;
+
+	for (i = 0; i < SHA256_MB_LANES; i++) {
+		buffer[i] = b->data;
+		size[i] = b->len;
+	}
+	sha256_get_pecoff_digest_mem_multi(buffer, size, hash, NULL,
+					   SHA256_MB_LANES);
+}
+
+static void
+bench_find_in_esl(void *arg)
+{
+	struct bench_buffer *b = arg;
+
+	find_in_esl(b->data, b->len, b->key, SHA256_DIGEST_SIZE);
+}
+
+static void
+bench_esl_index_find(void *arg)
+{
+	struct bench_buffer *b = arg;
+
+	esl_index_find(b->data, b->key);
+}
+
+static void
+bench_esl_bloom_find(void *arg)
+{
+	struct bench_buffer *b = arg;
+
+	esl_bloom_find(b->data, b->key);
+}
+
+static void
+bench_pecoff_relocate(void *arg)
+{
+	struct bench_buffer *b = arg;
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	void *data = b->data;
+
+	if (pecoff_read_header(&context, data) != EFI_SUCCESS
+	    || pecoff_relocate(&context, &data) != EFI_SUCCESS) {
+		fprintf(stderr, "failed to relocate benchmark image\n");
+		exit(1);
+	}
+	free(data);
+}
+
+static void
+bench_sha256(void)
+{
+	static const UINTN sizes[] = { 64, 1024, 16 * 1024, 256 * 1024,
+				       1024 * 1024 };
+	struct bench_buffer b;
+	int i;
+
+	b.data = bench_alloc(sizes[ARRAY_SIZE(sizes) - 1]);
+	synth_fill(b.data, sizes[ARRAY_SIZE(sizes) - 1]);
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		b.len = sizes[i];
+		bench_run("sha256_update", "embedded", b.len,
+			  bench_sha256_update, &b, b.len / 1e6, "MB/s");
+	}
+	free(b.data);
+}
+
+static void
+bench_pecoff_digest(void)
+{
+	struct bench_buffer b;
+	UINTN size;
+
+	for (size = 64 * 1024; size <= max_image; size *= 16) {
+		b.data = bench_generated(synth_pe_image(size, 8, 0, &b.len,
+							NULL));
+		bench_run("pecoff_digest", "embedded", b.len,
+			  bench_digest_embedded, &b, b.len / 1e6, "MB/s");
+		bench_run("pecoff_digest", "openssl", b.len,
+			  bench_digest_evp, &b, b.len / 1e6, "MB/s");
+		bench_run("pecoff_digest", "multi", b.len,
+			  bench_digest_multi, &b,
+			  SHA256_MB_LANES * b.len / 1e6, "MB/s");
+		free(b.data);
+	}
+}
+
+static void
+bench_esl_lookup(void)
+{
+	struct bench_buffer b, bi;
+	UINT8 missing[SHA256_DIGEST_SIZE];
+	esl_index idx;
+	esl_bloom bloom;
+	int n;
+
+	synth_fill(missing, sizeof(missing));
+	for (n = 1024; n <= max_entries; n *= 4) {
+		EFI_SIGNATURE_DATA *d;
+
+		b.data = bench_generated(synth_sha256_esl(n, &MOK_OWNER,
+							  &b.len));
+		b.key = missing;
+		bench_run("find_in_esl", "miss", n, bench_find_in_esl, &b,
+			  1, "lookups/s");
+		/* an entry from the middle of the list */
+		d = b.data + sizeof(EFI_SIGNATURE_LIST)
+			+ n / 2 * (sizeof(EFI_GUID) + SHA256_DIGEST_SIZE);
+		b.key = d->SignatureData;
+		bench_run("find_in_esl", "hit", n, bench_find_in_esl, &b,
+			  1, "lookups/s");
+
+		if (esl_index_build(&idx, b.data, b.len, SHA256_DIGEST_SIZE)
+		    != EFI_SUCCESS) {
+			fprintf(stderr, "failed to index benchmark list\n");
+			exit(1);
+		}
+		bi.data = &idx;
+		bi.key = missing;
+		bench_run("esl_index_find", "miss", n, bench_esl_index_find,
+			  &bi, 1, "lookups/s");
+		bi.key = b.key;
+		bench_run("esl_index_find", "hit", n, bench_esl_index_find,
+			  &bi, 1, "lookups/s");
+		esl_index_free(&idx);
+
+		if (esl_bloom_build(&bloom, b.data, b.len, SHA256_DIGEST_SIZE)
+		    != EFI_SUCCESS) {
+			fprintf(stderr, "failed to filter benchmark list\n");
+			exit(1);
+		}
+		bi.data = &bloom;
+		bi.key = missing;
+		bench_run("esl_bloom_find", "miss", n, bench_esl_bloom_find,
+			  &bi, 1, "lookups/s");
+		esl_bloom_free(&bloom);
+		free(b.data);
+	}
+}
+
+static void
+bench_relocate(void)
+{
+	struct bench_buffer b;
+	UINTN size, nrelocs;
+
+	for (size = 64 * 1024; size <= max_image && size <= 64 * 1024 * 1024;
+	     size *= 16) {
+		b.data = bench_generated(synth_pe_image(size, 1, 1, &b.len,
+							&nrelocs));
+		bench_run("pecoff_relocate", "dir64", b.len,
+			  bench_pecoff_relocate, &b, nrelocs, "relocs/s");
+		free(b.data);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *progname = argv[0];
+
+	while (argc > 1) {
+		if (strcmp("--version", argv[1]) == 0) {
+			version(progname);
+			exit(0);
+		} else if (strcmp("--help", argv[1]) == 0) {
+			help(progname);
+			exit(0);
+		} else if (strcmp("-t", argv[1]) == 0 && argc > 2) {
+			min_time = atof(argv[2]);
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-m", argv[1]) == 0 && argc > 2) {
+			max_image = strtoul(argv[2], NULL, 0);
+			argv += 2;
+			argc -= 2;
+		} else if (strcmp("-n", argv[1]) == 0 && argc > 2) {
+			max_entries = atoi(argv[2]);
+			argv += 2;
+			argc -= 2;
+		} else {
+			usage(progname);
+			exit(1);
+		}
+	}
+
+	printf("benchmark,variant,size,iterations,seconds,rate,unit\n");
+	bench_sha256();
+	bench_pecoff_digest();
+	bench_esl_lookup();
+	bench_relocate();
+
+	return 0;
+}
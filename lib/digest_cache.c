@@ -0,0 +1,385 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * A persistent cache of Authenticode digests.  The cache file is a small
+ * header followed by an open addressed table of fixed size records,
+ * mapped into memory and hashed by (device, inode).  A record is only
+ * believed if the size and both timestamps still match the file, so
+ * anything that rewrites a binary invalidates its entry.
+ *
+ * Next to it can live the Bloom filter of a signature list such as dbx,
+ * keyed the same way on the list file, so a tool that only wants to know
+ * a binary isn't revoked needn't read or parse the list at all.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <digest_cache.h>
+
+#define DIGEST_CACHE_MAGIC	"EFIDGST1"
+#define DIGEST_CACHE_MIN	1024	/* initial records, a power of two */
+#define DIGEST_BLOOM_MAGIC	"EFIBLM01"
+
+struct digest_cache_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t pad;
+	uint64_t capacity;
+	uint64_t used;
+};
+
+struct digest_cache_record {
+	uint64_t dev;
+	uint64_t ino;		/* zero for an empty slot */
+	uint64_t size;
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+	uint8_t hash[SHA256_DIGEST_SIZE];
+};
+
+struct digest_bloom_header {
+	char magic[8];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+	uint64_t keylen;
+	uint64_t blocks;
+};
+
+struct digest_cache {
+	int fd;
+	size_t len;
+	struct digest_cache_header *hdr;
+	struct digest_cache_record *rec;
+};
+
+static size_t
+digest_cache_len(uint64_t capacity)
+{
+	return sizeof(struct digest_cache_header)
+		+ capacity * sizeof(struct digest_cache_record);
+}
+
+static int
+digest_cache_map(struct digest_cache *dc, uint64_t capacity)
+{
+	dc->len = digest_cache_len(capacity);
+	dc->hdr = mmap(NULL, dc->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       dc->fd, 0);
+	if (dc->hdr == MAP_FAILED)
+		return errno;
+	dc->rec = (void *)(dc->hdr + 1);
+	return 0;
+}
+
+/* (re)create an empty table of the given capacity */
+static int
+digest_cache_init(struct digest_cache *dc, uint64_t capacity)
+{
+	int ret;
+
+	if (ftruncate(dc->fd, 0) < 0
+	    || ftruncate(dc->fd, digest_cache_len(capacity)) < 0)
+		return errno;
+	ret = digest_cache_map(dc, capacity);
+	if (ret)
+		return ret;
+	memcpy(dc->hdr->magic, DIGEST_CACHE_MAGIC, sizeof(dc->hdr->magic));
+	dc->hdr->record_size = sizeof(struct digest_cache_record);
+	dc->hdr->capacity = capacity;
+	dc->hdr->used = 0;
+	return 0;
+}
+
+static uint64_t
+digest_cache_slot(struct digest_cache *dc, uint64_t dev, uint64_t ino)
+{
+	uint64_t h = ino * 0x9E3779B97F4A7C15ULL ^ dev;
+
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 29;
+	return h & (dc->hdr->capacity - 1);
+}
+
+/*
+ * The record for (dev, ino), or the empty slot it would go in; NULL if
+ * it isn't there and there is no empty slot, which only a corrupt table
+ * can manage.
+ */
+static struct digest_cache_record *
+digest_cache_find(struct digest_cache *dc, uint64_t dev, uint64_t ino)
+{
+	uint64_t n, i = digest_cache_slot(dc, dev, ino);
+
+	for (n = 0; n < dc->hdr->capacity; n++) {
+		struct digest_cache_record *r = &dc->rec[i];
+
+		if (r->ino == 0 || (r->ino == ino && r->dev == dev))
+			return r;
+		i = (i + 1) & (dc->hdr->capacity - 1);
+	}
+	return NULL;
+}
+
+/*
+ * Double the table, rehashing every record into the new one.  The new
+ * table is mapped before the old one goes, so on failure dc is still
+ * the old table.
+ */
+static int
+digest_cache_grow(struct digest_cache *dc)
+{
+	uint64_t i, capacity = dc->hdr->capacity;
+	size_t len = capacity * sizeof(struct digest_cache_record),
+		newlen = digest_cache_len(capacity * 2);
+	struct digest_cache_record *old = malloc(len), *r;
+	struct digest_cache_header *hdr;
+	int ret = 0;
+
+	if (!old)
+		return ENOMEM;
+	memcpy(old, dc->rec, len);
+
+	if (ftruncate(dc->fd, newlen) < 0) {
+		ret = errno;
+		goto out;
+	}
+	hdr = mmap(NULL, newlen, PROT_READ | PROT_WRITE, MAP_SHARED, dc->fd, 0);
+	if (hdr == MAP_FAILED) {
+		ret = errno;
+		ftruncate(dc->fd, dc->len);
+		goto out;
+	}
+	munmap(dc->hdr, dc->len);
+	dc->hdr = hdr;
+	dc->rec = (void *)(hdr + 1);
+	dc->len = newlen;
+
+	memset(dc->rec, 0, capacity * 2 * sizeof(*dc->rec));
+	dc->hdr->capacity = capacity * 2;
+	dc->hdr->used = 0;
+	for (i = 0; i < capacity; i++) {
+		if (old[i].ino == 0)
+			continue;
+		r = digest_cache_find(dc, old[i].dev, old[i].ino);
+		if (r->ino == 0)
+			dc->hdr->used++;
+		*r = old[i];
+	}
+ out:
+	free(old);
+	return ret;
+}
+
+/*
+ * Open (creating if necessary) the cache at path.  The file is locked
+ * until digest_cache_close(), so concurrent users take turns.  A file
+ * that isn't a valid cache is silently reinitialised.
+ */
+struct digest_cache *
+digest_cache_open(const char *path)
+{
+	struct digest_cache *dc = malloc(sizeof(*dc));
+	struct digest_cache_header hdr;
+	struct stat st;
+	int ret;
+
+	if (!dc)
+		return NULL;
+	dc->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (dc->fd < 0)
+		goto out_free;
+	if (flock(dc->fd, LOCK_EX) < 0 || fstat(dc->fd, &st) < 0)
+		goto out_close;
+
+	if (st.st_size >= sizeof(hdr)
+	    && pread(dc->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+	    && memcmp(hdr.magic, DIGEST_CACHE_MAGIC, sizeof(hdr.magic)) == 0
+	    && hdr.record_size == sizeof(struct digest_cache_record)
+	    && hdr.capacity >= DIGEST_CACHE_MIN
+	    && (hdr.capacity & (hdr.capacity - 1)) == 0
+	    && hdr.used * 4 < hdr.capacity * 3
+	    && st.st_size == digest_cache_len(hdr.capacity))
+		ret = digest_cache_map(dc, hdr.capacity);
+	else
+		ret = digest_cache_init(dc, DIGEST_CACHE_MIN);
+	if (ret) {
+		errno = ret;
+		goto out_close;
+	}
+	return dc;
+
+ out_close:
+	ret = errno;
+	close(dc->fd);
+	errno = ret;
+ out_free:
+	free(dc);
+	return NULL;
+}
+
+void
+digest_cache_close(struct digest_cache *dc)
+{
+	if (!dc)
+		return;
+	munmap(dc->hdr, dc->len);
+	close(dc->fd);
+	free(dc);
+}
+
+/* returns 1 and fills in hash if the file described by st is cached */
+int
+digest_cache_lookup(struct digest_cache *dc, struct stat *st,
+		    uint8_t hash[SHA256_DIGEST_SIZE])
+{
+	struct digest_cache_record *r;
+
+	if (!dc || st->st_ino == 0)
+		return 0;
+	r = digest_cache_find(dc, st->st_dev, st->st_ino);
+	if (!r || r->ino == 0
+	    || r->size != st->st_size
+	    || r->mtime_ns != st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec
+	    || r->ctime_ns != st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec)
+		return 0;
+	memcpy(hash, r->hash, SHA256_DIGEST_SIZE);
+	return 1;
+}
+
+int
+digest_cache_insert(struct digest_cache *dc, struct stat *st,
+		    uint8_t hash[SHA256_DIGEST_SIZE])
+{
+	struct digest_cache_record *r;
+	int ret;
+
+	if (!dc || st->st_ino == 0)
+		return 0;
+	/* keep the table at most three quarters full */
+	if ((dc->hdr->used + 1) * 4 > dc->hdr->capacity * 3) {
+		ret = digest_cache_grow(dc);
+		if (ret)
+			return ret;
+	}
+	r = digest_cache_find(dc, st->st_dev, st->st_ino);
+	if (!r)
+		return EIO;
+	if (r->ino == 0)
+		dc->hdr->used++;
+	r->dev = st->st_dev;
+	r->ino = st->st_ino;
+	r->size = st->st_size;
+	r->mtime_ns = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+	r->ctime_ns = st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+	memcpy(r->hash, hash, SHA256_DIGEST_SIZE);
+	return 0;
+}
+
+static void
+digest_bloom_key(struct digest_bloom_header *hdr, struct stat *st)
+{
+	hdr->dev = st->st_dev;
+	hdr->ino = st->st_ino;
+	hdr->size = st->st_size;
+	hdr->mtime_ns = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+	hdr->ctime_ns = st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+}
+
+/*
+ * Returns 1 and fills in bloom if path holds the filter of the keylen
+ * sized entries of the signature list file described by st, and the list
+ * hasn't changed since.
+ */
+int
+digest_cache_bloom_load(const char *path, struct stat *st, size_t keylen,
+			esl_bloom *bloom)
+{
+	struct digest_bloom_header hdr, key;
+	size_t len;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	digest_bloom_key(&key, st);
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	    || memcmp(hdr.magic, DIGEST_BLOOM_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.dev != key.dev || hdr.ino != key.ino
+	    || hdr.size != key.size || hdr.mtime_ns != key.mtime_ns
+	    || hdr.ctime_ns != key.ctime_ns || hdr.keylen != keylen
+	    || hdr.blocks == 0 || (hdr.blocks & (hdr.blocks - 1)) != 0
+	    || hdr.blocks > SIZE_MAX / (ESL_BLOOM_BLOCK_WORDS * sizeof(UINT64)))
+		goto out;
+
+	len = hdr.blocks * ESL_BLOOM_BLOCK_WORDS * sizeof(UINT64);
+	bloom->bits = malloc(len);
+	if (!bloom->bits)
+		goto out;
+	if (read(fd, bloom->bits, len) != len) {
+		free(bloom->bits);
+		bloom->bits = NULL;
+		goto out;
+	}
+	bloom->keylen = hdr.keylen;
+	bloom->blocks = hdr.blocks;
+	ret = 1;
+ out:
+	close(fd);
+	return ret;
+}
+
+/* save bloom as the filter of the list file described by st */
+int
+digest_cache_bloom_save(const char *path, struct stat *st, esl_bloom *bloom)
+{
+	struct digest_bloom_header hdr;
+	size_t len = bloom->blocks * ESL_BLOOM_BLOCK_WORDS * sizeof(UINT64);
+	char *tmp;
+	int fd, ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DIGEST_BLOOM_MAGIC, sizeof(hdr.magic));
+	digest_bloom_key(&hdr, st);
+	hdr.keylen = bloom->keylen;
+	hdr.blocks = bloom->blocks;
+
+	/* written aside and renamed, so readers never see half a filter */
+	tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (!tmp)
+		return ENOMEM;
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = errno;
+		free(tmp);
+		return ret;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	    || write(fd, bloom->bits, len) != len
+	    || fchmod(fd, 0644) < 0
+	    || rename(tmp, path) < 0) {
+		ret = EIO;
+		unlink(tmp);
+	}
+	close(fd);
+	free(tmp);
+	return ret;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * OpenSSL digests as Authenticode digest engines for the userspace
+ * tools.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/evp.h>
+
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <sha256.h>
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+
+/* not EVP_get_digestbyname(), which needs the caller to have loaded the
+ * digest table first */
+static const EVP_MD *
+evp_md(const digest_engine *engine)
+{
+	if (engine == &evp_sha1_engine)
+		return EVP_sha1();
+	if (engine == &evp_sha256_engine)
+		return EVP_sha256();
+	if (engine == &evp_sha384_engine)
+		return EVP_sha384();
+	if (engine == &evp_sha512_engine)
+		return EVP_sha512();
+	return NULL;
+}
+
+static void *
+evp_engine_init(const digest_engine *engine)
+{
+	const EVP_MD *md = evp_md(engine);
+	EVP_MD_CTX *ctx;
+
+	if (!md)
+		return NULL;
+	ctx = EVP_MD_CTX_create();
+	if (!ctx)
+		return NULL;
+	if (!EVP_DigestInit_ex(ctx, md, NULL)) {
+		EVP_MD_CTX_destroy(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void
+evp_engine_update(void *ctx, void *data, UINTN len)
+{
+	EVP_DigestUpdate(ctx, data, len);
+}
+
+static void
+evp_engine_final(void *ctx, UINT8 *digest)
+{
+	EVP_DigestFinal_ex(ctx, digest, NULL);
+	EVP_MD_CTX_destroy(ctx);
+}
+
+#define EVP_ENGINE(alg, bytes)				\
+	const digest_engine evp_##alg##_engine = {	\
+		.name = #alg,				\
+		.size = bytes,				\
+		.init = evp_engine_init,		\
+		.update = evp_engine_update,		\
+		.final = evp_engine_final,		\
+	}
+
+EVP_ENGINE(sha1, 20);
+EVP_ENGINE(sha256, 32);
+EVP_ENGINE(sha384, 48);
+EVP_ENGINE(sha512, 64);
+
+static const digest_engine *engines[] = {
+	&evp_sha1_engine,
+	&evp_sha256_engine,
+	&evp_sha384_engine,
+	&evp_sha512_engine,
+};
+
+/* find the engine for a digest name like "sha384", NULL if there's none */
+const digest_engine *
+digest_engine_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(engines); i++)
+		if (strcasecmp(name, engines[i]->name) == 0)
+			return engines[i];
+	return NULL;
+}
@@ -0,0 +1,515 @@
+/*
+ * Copyright 2012 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * Signature list handling that needs no firmware services, so it is
+ * built for both EFI and the userspace tools.
+ */
+#include <efi.h>
+#include <efilib.h>
+
+#include <variables.h>
+#include <guid.h>
+
+#ifndef BUILD_EFI
+#include <stdlib.h>
+#include <string.h>
+#define CompareMem(a, b, l) memcmp(a, b, l)
+#define CopyMem(d, s, l) memcpy(d, s, l)
+#define ZeroMem(s, l) memset(s, 0, l)
+#define AllocatePool(x) malloc(x)
+#define AllocateZeroPool(x) calloc(1, x)
+#define FreePool(s) free(s)
+#endif
+
+static struct {
+	EFI_GUID *guid;
+	esl_type type;
+	const char *name;
+} esl_types[] = {
+	{ NULL, ESL_TYPE_UNKNOWN, "Unknown" },
+	{ &X509_GUID, ESL_TYPE_X509, "X509" },
+	{ &RSA2048_GUID, ESL_TYPE_RSA2048, "RSA2048" },
+	{ &PKCS7_GUID, ESL_TYPE_PKCS7, "PKCS7" },
+	{ &EFI_CERT_SHA256_GUID, ESL_TYPE_SHA256, "SHA256" },
+};
+
+esl_type
+esl_type_from_guid(EFI_GUID *guid)
+{
+	UINTN i;
+
+	for (i = 1; i < sizeof(esl_types)/sizeof(esl_types[0]); i++)
+		if (CompareMem(guid, esl_types[i].guid, sizeof(EFI_GUID)) == 0)
+			return esl_types[i].type;
+	return ESL_TYPE_UNKNOWN;
+}
+
+const char *
+esl_type_name(esl_type type)
+{
+	if (type >= sizeof(esl_types)/sizeof(esl_types[0]))
+		type = ESL_TYPE_UNKNOWN;
+	return esl_types[type].name;
+}
+
+/* is there a well formed list at offset, given size bytes of blob? */
+static BOOLEAN
+esl_list_valid(UINT8 *Data, UINTN offset, UINTN size)
+{
+	EFI_SIGNATURE_LIST *CertList = (EFI_SIGNATURE_LIST *)(Data + offset);
+	UINTN left = size - offset, body;
+
+	if (left < sizeof(*CertList)
+	    || CertList->SignatureListSize > left
+	    || CertList->SignatureListSize < sizeof(*CertList)
+	    || CertList->SignatureHeaderSize
+	       > CertList->SignatureListSize - sizeof(*CertList)
+	    || CertList->SignatureSize < sizeof(EFI_GUID))
+		return FALSE;
+	body = CertList->SignatureListSize - sizeof(*CertList)
+		- CertList->SignatureHeaderSize;
+	return body % CertList->SignatureSize == 0;
+}
+
+/*
+ * Check the lists in Data and set up a view of them.  A malformed list
+ * or trailing bytes give EFI_INVALID_PARAMETER, but the view still
+ * covers the good lists before them, which is what the old iterators
+ * would have walked.
+ */
+EFI_STATUS
+esl_view_init(esl_view *view, void *Data, UINTN DataSize)
+{
+	EFI_SIGNATURE_LIST *CertList;
+	UINTN offset = 0;
+
+	ZeroMem(view, sizeof(*view));
+	view->data = Data;
+	while (offset < DataSize) {
+		if (!esl_list_valid(Data, offset, DataSize))
+			break;
+		CertList = (EFI_SIGNATURE_LIST *)(view->data + offset);
+		view->entries += (CertList->SignatureListSize - sizeof(*CertList)
+				  - CertList->SignatureHeaderSize)
+			/ CertList->SignatureSize;
+		view->lists++;
+		offset += CertList->SignatureListSize;
+	}
+	view->size = offset;
+	return offset == DataSize ? EFI_SUCCESS : EFI_INVALID_PARAMETER;
+}
+
+/* step list on to the next list in view; list->list NULL starts over */
+BOOLEAN
+esl_view_next(esl_view *view, esl_list *list)
+{
+	EFI_SIGNATURE_LIST *CertList;
+	UINTN offset;
+
+	if (list->list) {
+		offset = (UINT8 *)list->list - view->data
+			+ list->list->SignatureListSize;
+		list->index++;
+	} else {
+		offset = 0;
+		list->index = 0;
+	}
+	if (offset >= view->size)
+		return FALSE;
+
+	CertList = (EFI_SIGNATURE_LIST *)(view->data + offset);
+	list->list = CertList;
+	list->type = esl_type_from_guid(&CertList->SignatureType);
+	list->entry = (UINT8 *)CertList + sizeof(*CertList)
+		+ CertList->SignatureHeaderSize;
+	list->entry_size = CertList->SignatureSize;
+	list->data_size = CertList->SignatureSize - sizeof(EFI_GUID);
+	list->count = (CertList->SignatureListSize - sizeof(*CertList)
+		       - CertList->SignatureHeaderSize) / CertList->SignatureSize;
+	return TRUE;
+}
+
+/*
+ * The index'th list of the view.  Lists have no fixed size, so this
+ * walks the headers, but blobs hold a handful of lists at most; entries
+ * within a list are reached directly with esl_list_entry().
+ */
+EFI_STATUS
+esl_view_list(esl_view *view, UINTN index, esl_list *list)
+{
+	if (index >= view->lists)
+		return EFI_NOT_FOUND;
+	esl_view_for_each_list(view, list)
+		if (list->index == index)
+			break;
+	return EFI_SUCCESS;
+}
+
+/*
+ * SHA256 lists are by far the longest (dbx has hundreds of entries) and
+ * have a fixed 48 byte stride, so they get a scanner that compares the
+ * first eight bytes of the key against several entries at once and only
+ * does the full compare on a match.  The scanners return the matching
+ * EFI_SIGNATURE_DATA or NULL.
+ */
+#define ESL_SHA256_STRIDE	(sizeof(EFI_GUID) + SHA256_DIGEST_SIZE)
+
+typedef UINT8 *(*esl_scan_fn)(UINT8 *entry, UINTN count, UINT8 *key);
+
+static UINT8 *
+esl_scan_check(UINT8 *entry, UINT8 *key)
+{
+	if (CompareMem(entry + sizeof(EFI_GUID), key, SHA256_DIGEST_SIZE) == 0)
+		return entry;
+	return NULL;
+}
+
+static UINT8 *
+esl_scan_generic(UINT8 *entry, UINTN count, UINT8 *key)
+{
+	UINT64 prefix, e;
+
+	CopyMem(&prefix, key, sizeof(prefix));
+	for (; count; count--, entry += ESL_SHA256_STRIDE) {
+		CopyMem(&e, entry + sizeof(EFI_GUID), sizeof(e));
+		if (e == prefix && esl_scan_check(entry, key))
+			return entry;
+	}
+	return NULL;
+}
+
+static esl_scan_fn esl_scan = NULL;
+
+#if defined(__x86_64__)
+/*
+ * SSE2 is part of x86_64, so that scanner is always there, the EFI
+ * binaries included.  AVX2 is userspace only: firmware need not enable
+ * the YMM state.
+ */
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define ESL_PREFIX(entry, i) \
+	(*(UINT64 *)((entry) + (i) * ESL_SHA256_STRIDE + sizeof(EFI_GUID)))
+
+/* two entries per compare; a 64 bit match is both 32 bit halves */
+static UINT8 *
+esl_scan_sse2(UINT8 *entry, UINTN count, UINT8 *key)
+{
+	__m128i needle = _mm_set1_epi64x(*(UINT64 *)key);
+	UINTN i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i a = _mm_set_epi64x(ESL_PREFIX(entry, i + 1),
+					   ESL_PREFIX(entry, i));
+		__m128i b = _mm_set_epi64x(ESL_PREFIX(entry, i + 3),
+					   ESL_PREFIX(entry, i + 2));
+		int ma = _mm_movemask_epi8(_mm_cmpeq_epi32(a, needle));
+		int mb = _mm_movemask_epi8(_mm_cmpeq_epi32(b, needle));
+		int j;
+
+		if (((ma & 0xff) != 0xff) && ((ma >> 8) != 0xff)
+		    && ((mb & 0xff) != 0xff) && ((mb >> 8) != 0xff))
+			continue;
+		for (j = 0; j < 4; j++)
+			if (ESL_PREFIX(entry, i + j) == *(UINT64 *)key
+			    && esl_scan_check(entry + (i + j) * ESL_SHA256_STRIDE,
+					      key))
+				return entry + (i + j) * ESL_SHA256_STRIDE;
+	}
+	return esl_scan_generic(entry + i * ESL_SHA256_STRIDE, count - i, key);
+}
+
+#ifndef BUILD_EFI
+/* four entries per compare, gathered straight from the list */
+static UINT8 * __attribute__((target("avx2")))
+esl_scan_avx2(UINT8 *entry, UINTN count, UINT8 *key)
+{
+	const __m256i stride = _mm256_set_epi64x(3 * ESL_SHA256_STRIDE,
+						 2 * ESL_SHA256_STRIDE,
+						 ESL_SHA256_STRIDE, 0);
+	__m256i needle = _mm256_set1_epi64x(*(UINT64 *)key);
+	UINT8 *data = entry + sizeof(EFI_GUID);
+	UINTN i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m256i a = _mm256_i64gather_epi64(
+			(const long long *)(data + i * ESL_SHA256_STRIDE),
+			stride, 1);
+		__m256i b = _mm256_i64gather_epi64(
+			(const long long *)(data + (i + 4) * ESL_SHA256_STRIDE),
+			stride, 1);
+		int m = _mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpeq_epi64(a, needle)))
+			| _mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpeq_epi64(b, needle))) << 4;
+
+		while (m) {
+			int j = __builtin_ctz(m);
+
+			if (esl_scan_check(entry + (i + j) * ESL_SHA256_STRIDE,
+					   key))
+				return entry + (i + j) * ESL_SHA256_STRIDE;
+			m &= m - 1;
+		}
+	}
+	return esl_scan_sse2(entry + i * ESL_SHA256_STRIDE, count - i, key);
+}
+#endif
+
+static void
+esl_select_scan(void)
+{
+	esl_scan = esl_scan_sse2;
+#ifndef BUILD_EFI
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int ecx1;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx1, &edx))
+		return;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		ebx = 0;
+	/* AVX2 also needs the OS to have enabled the YMM state in XCR0 */
+	if ((ebx & bit_AVX2) && (ecx1 & bit_OSXSAVE) && (ecx1 & bit_AVX)) {
+		unsigned int xcr0_lo, xcr0_hi;
+
+		__asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+		if ((xcr0_lo & 0x6) == 0x6)
+			esl_scan = esl_scan_avx2;
+	}
+#endif
+}
+#else
+static void
+esl_select_scan(void)
+{
+	esl_scan = esl_scan_generic;
+}
+#endif /* __x86_64__ */
+
+EFI_STATUS
+find_in_esl(UINT8 *Data, UINTN DataSize, UINT8 *key, UINTN keylen)
+{
+	esl_view view;
+	esl_list l;
+	EFI_SIGNATURE_DATA *Cert;
+	UINTN i;
+
+	esl_view_init(&view, Data, DataSize);
+	esl_view_for_each_list(&view, &l) {
+		if (l.data_size != keylen)
+			continue;
+
+		if (keylen == SHA256_DIGEST_SIZE) {
+			if (!esl_scan)
+				esl_select_scan();
+			if (esl_scan(l.entry, l.count, key))
+				return EFI_SUCCESS;
+			continue;
+		}
+
+		esl_list_for_each_entry(&l, Cert, i)
+			if (CompareMem (Cert->SignatureData, key, keylen) == 0)
+				return EFI_SUCCESS;
+	}
+	return EFI_NOT_FOUND;
+}
+
+/*
+ * Hash a key for the index and the Bloom filter: signature list keys
+ * are mostly digests, which are already well mixed, but certificates
+ * and the like start with the same few bytes, so mix in the tail as well
+ * as the head of the key.
+ */
+static UINT64
+esl_key_hash(UINT8 *key, UINTN keylen)
+{
+	UINT64 head, tail;
+
+	CopyMem(&head, key, sizeof(head));
+	CopyMem(&tail, key + keylen - sizeof(tail), sizeof(tail));
+	head ^= tail * 0x9e3779b97f4a7c15ULL;
+	head ^= head >> 29;
+	return head * 0xbf58476d1ce4e5b9ULL;
+}
+
+static UINTN
+esl_index_slot(esl_index *idx, UINT8 *key)
+{
+	return (UINTN)(esl_key_hash(key, idx->keylen) >> 32) & idx->mask;
+}
+
+/*
+ * Build an index of every keylen sized entry in the signature lists in
+ * Data, so the same blob can be searched repeatedly in constant time.
+ * The index takes a copy of the keys, so Data may be freed afterwards.
+ */
+EFI_STATUS
+esl_index_build(esl_index *idx, UINT8 *Data, UINTN DataSize, UINTN keylen)
+{
+	esl_view view;
+	esl_list l;
+	EFI_SIGNATURE_DATA *Cert;
+	UINTN i, count = 0, nslots = 16;
+
+	ZeroMem(idx, sizeof(*idx));
+	if (keylen < sizeof(UINT64))
+		return EFI_INVALID_PARAMETER;
+	idx->keylen = keylen;
+
+	esl_view_init(&view, Data, DataSize);
+	esl_view_for_each_list(&view, &l)
+		if (l.data_size == keylen)
+			count += l.count;
+	if (count == 0)
+		return EFI_SUCCESS;
+
+	/* keep the table at most half full */
+	while (nslots < 2 * count)
+		nslots *= 2;
+	idx->mask = nslots - 1;
+	idx->keys = AllocatePool(count * keylen);
+	idx->slots = AllocateZeroPool(nslots * sizeof(*idx->slots));
+	if (!idx->keys || !idx->slots) {
+		esl_index_free(idx);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	esl_view_for_each_list(&view, &l) {
+		if (l.data_size != keylen)
+			continue;
+		esl_list_for_each_entry(&l, Cert, i) {
+			if (esl_index_find(idx, Cert->SignatureData)
+			    == EFI_SUCCESS)
+				continue;
+
+			UINTN slot = esl_index_slot(idx, Cert->SignatureData);
+
+			while (idx->slots[slot])
+				slot = (slot + 1) & idx->mask;
+			CopyMem(idx->keys + idx->count * keylen,
+				Cert->SignatureData, keylen);
+			idx->slots[slot] = ++idx->count;
+		}
+	}
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+esl_index_find(esl_index *idx, UINT8 *key)
+{
+	UINTN slot;
+
+	if (idx->count == 0)
+		return EFI_NOT_FOUND;
+
+	for (slot = esl_index_slot(idx, key); idx->slots[slot];
+	     slot = (slot + 1) & idx->mask)
+		if (CompareMem(idx->keys + (idx->slots[slot] - 1) * idx->keylen,
+			       key, idx->keylen) == 0)
+			return EFI_SUCCESS;
+	return EFI_NOT_FOUND;
+}
+
+void
+esl_index_free(esl_index *idx)
+{
+	if (idx->keys)
+		FreePool(idx->keys);
+	if (idx->slots)
+		FreePool(idx->slots);
+	ZeroMem(idx, sizeof(*idx));
+}
+
+/*
+ * A blocked Bloom filter: every key sets ESL_BLOOM_K bits in one 64 byte
+ * block, so asking about a key touches a single cache line.  At 16 bits
+ * per key about one lookup in a thousand gets a false "maybe".
+ */
+#define ESL_BLOOM_BITS_PER_KEY	16
+#define ESL_BLOOM_K		6
+
+static UINT64 *
+esl_bloom_block(esl_bloom *bloom, UINT64 h)
+{
+	return bloom->bits + ((UINTN)(h >> 32) & (bloom->blocks - 1))
+		* ESL_BLOOM_BLOCK_WORDS;
+}
+
+static void
+esl_bloom_add(esl_bloom *bloom, UINT8 *key)
+{
+	UINT64 h = esl_key_hash(key, bloom->keylen), *block;
+	int i;
+
+	block = esl_bloom_block(bloom, h);
+	h *= 0x94d049bb133111ebULL;
+	for (i = 0; i < ESL_BLOOM_K; i++, h >>= 9)
+		block[(h & 0x1ff) / 64] |= 1ULL << (h & 63);
+}
+
+/*
+ * Build a filter of every keylen sized entry in the signature lists in
+ * Data.  The filter can only say a key is definitely not there, so
+ * anything it lets through still has to be looked up.
+ */
+EFI_STATUS
+esl_bloom_build(esl_bloom *bloom, UINT8 *Data, UINTN DataSize, UINTN keylen)
+{
+	esl_view view;
+	esl_list l;
+	EFI_SIGNATURE_DATA *Cert;
+	UINTN i, count = 0, blocks = 1;
+
+	ZeroMem(bloom, sizeof(*bloom));
+	if (keylen < sizeof(UINT64))
+		return EFI_INVALID_PARAMETER;
+
+	esl_view_init(&view, Data, DataSize);
+	esl_view_for_each_list(&view, &l)
+		if (l.data_size == keylen)
+			count += l.count;
+	while (blocks * ESL_BLOOM_BLOCK_WORDS * 64
+	       < count * ESL_BLOOM_BITS_PER_KEY)
+		blocks *= 2;
+
+	bloom->bits = AllocateZeroPool(blocks * ESL_BLOOM_BLOCK_WORDS
+				       * sizeof(UINT64));
+	if (!bloom->bits)
+		return EFI_OUT_OF_RESOURCES;
+	bloom->keylen = keylen;
+	bloom->blocks = blocks;
+
+	esl_view_for_each_list(&view, &l) {
+		if (l.data_size != keylen)
+			continue;
+		esl_list_for_each_entry(&l, Cert, i)
+			esl_bloom_add(bloom, Cert->SignatureData);
+	}
+	return EFI_SUCCESS;
+}
+
+/* EFI_NOT_FOUND if key is definitely absent, EFI_SUCCESS if it may not be */
+EFI_STATUS
+esl_bloom_find(esl_bloom *bloom, UINT8 *key)
+{
+	UINT64 h = esl_key_hash(key, bloom->keylen), *block;
+	int i;
+
+	block = esl_bloom_block(bloom, h);
+	h *= 0x94d049bb133111ebULL;
+	for (i = 0; i < ESL_BLOOM_K; i++, h >>= 9)
+		if (!(block[(h & 0x1ff) / 64] & (1ULL << (h & 63))))
+			return EFI_NOT_FOUND;
+	return EFI_SUCCESS;
+}
+
+void
+esl_bloom_free(esl_bloom *bloom)
+{
+	if (bloom->bits)
+		FreePool(bloom->bits);
+	ZeroMem(bloom, sizeof(*bloom));
+}
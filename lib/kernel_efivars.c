@@ -3,6 +3,7 @@
  *
  * see COPYING file
  */
+#define _GNU_SOURCE		/* for O_PATH */
 #include <stdlib.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -11,7 +12,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/vfs.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
@@ -24,113 +28,932 @@
 #include <sha256.h>
 #include "efiauthenticated.h"
 
+#define EFIVARFS_DEFAULT_PATH	"/sys/firmware/efi/efivars"
+#define EFIVARFS_ENV		"EFIVARFS_PATH"
+#define EFIVARFS_MAGIC		0xde5e81e4
+
 static char *kernel_efi_path = NULL;
+/* O_PATH fd of kernel_efi_path that all the variables are opened from */
+static int kernel_efi_dir = -1;
 
-void
-kernel_variable_init(void)
+/* undo the octal escapes (\040 for space and so on) of mountinfo */
+static void
+mountinfo_unescape(char *str)
 {
-	char fname[] = "/tmp/efi.XXXXXX";
-	char cmdline[256];
-	int fd, ret;
-	struct stat st;
-	char *buf;
+	char *out = str;
 
-	if (kernel_efi_path)
-		return;
-	mktemp(fname);
-	snprintf(cmdline, sizeof(cmdline), "mount -l > %s", fname);
-	ret = system(cmdline);
-	if (WEXITSTATUS(ret) != 0)
-		/* hopefully stderr said what was wrong */
-		exit(1);
-	fd = open(fname, O_RDONLY);
-	unlink(fname);
-	if (fd < 0) {
-		fprintf(stderr, "Failed to open output of %s\n", cmdline);
-		exit(1);
+	while (*str) {
+		if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3'
+		    && str[2] >= '0' && str[2] <= '7'
+		    && str[3] >= '0' && str[3] <= '7') {
+			*out++ = (str[1] - '0') << 6 | (str[2] - '0') << 3
+				| (str[3] - '0');
+			str += 4;
+		} else {
+			*out++ = *str++;
+		}
 	}
-	if (fstat(fd, &st) < 0) {
-		perror("stat failed");
-		exit(1);
+	*out = '\0';
+}
+
+/*
+ * The mount point of the first efivarfs in /proc/self/mountinfo, whose
+ * lines are
+ *
+ *	id parent major:minor root mountpoint options [tags...] - type source superopts
+ */
+static char *
+mountinfo_efivarfs(void)
+{
+	FILE *f = fopen("/proc/self/mountinfo", "r");
+	char line[4096], *path = NULL;
+
+	if (!f)
+		return NULL;
+	while (!path && fgets(line, sizeof(line), f)) {
+		char *sep = strstr(line, " - "), *mnt, *save;
+		int i;
+
+		if (!sep || strncmp(sep + 3, "efivarfs ", 9) != 0)
+			continue;
+		*sep = '\0';
+		mnt = strtok_r(line, " ", &save);
+		for (i = 0; mnt && i < 4; i++)
+			mnt = strtok_r(NULL, " ", &save);
+		if (!mnt)
+			continue;
+		mountinfo_unescape(mnt);
+		path = strdup(mnt);
 	}
-	if (st.st_size == 0) {
-		fprintf(stderr, "No efivarfs filesystem is mounted\n");
-		exit(1);
+	fclose(f);
+	return path;
+}
+
+/*
+ * Use the efivarfs at path from now on, or NULL to look for one: the
+ * EFIVARFS_PATH environment variable, then /proc/self/mountinfo, then
+ * the usual mount point.  Returns 0 or an errno.
+ */
+int
+kernel_variable_set_path(const char *path)
+{
+	struct statfs sfs;
+	char *p;
+	int fd, guess = 0;
+
+	if (path)
+		p = strdup(path);
+	else if ((path = getenv(EFIVARFS_ENV)) && *path)
+		p = strdup(path);
+	else if (!(p = mountinfo_efivarfs())) {
+		/* no /proc; the mount point is there even if unmounted */
+		p = strdup(EFIVARFS_DEFAULT_PATH);
+		guess = 1;
 	}
-	buf = malloc(st.st_size);
-	read(fd, buf, st.st_size);
-	close(fd);
+	if (!p)
+		return ENOMEM;
 
-	char *ptr = buf;
-	char path[512], type[512];
-	while (ptr < buf + st.st_size) {
-		int count;
+	fd = open(p, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || (guess && (fstatfs(fd, &sfs) < 0
+				 || sfs.f_type != EFIVARFS_MAGIC))) {
+		int err = fd < 0 ? errno : ENOENT;
 
-		sscanf(ptr, "%*s on %s type %s %*[^\n]\n%n", path, type, &count);
-		ptr += count;
-		if (strcmp(type, "efivarfs") == 0)
-			break;
+		if (fd >= 0)
+			close(fd);
+		free(p);
+		return err;
 	}
-	if (strcmp(type, "efivarfs") != 0) {
+	if (kernel_efi_dir >= 0)
+		close(kernel_efi_dir);
+	free(kernel_efi_path);
+	kernel_efi_path = p;
+	kernel_efi_dir = fd;
+	return 0;
+}
+
+void
+kernel_variable_init(void)
+{
+	if (kernel_efi_path)
+		return;
+	if (kernel_variable_set_path(NULL) != 0) {
 		fprintf(stderr, "No efivarfs filesystem is mounted\n");
 		exit(1);
 	}
-	kernel_efi_path = malloc(strlen(path) + 1);
-	strcpy(kernel_efi_path, path);
+}
+
+/* the efivarfs file name of a variable */
+static char *
+kernel_variable_name(const char *var, EFI_GUID *guid)
+{
+	int len = strlen(var) + 48;
+	char *name = malloc(len);
+
+	if (name)
+		snprintf(name, len, "%s-%s", var, guid_to_str(guid));
+	return name;
+}
+
+static int
+kernel_variable_open(const char *var, EFI_GUID *guid, int flags)
+{
+	char *varfs = kernel_variable_name(var, guid);
+	int fd;
+
+	if (!varfs) {
+		errno = ENOMEM;
+		return -1;
+	}
+	fd = openat(kernel_efi_dir, varfs, flags | O_CLOEXEC, 0644);
+	free(varfs);
+	return fd;
+}
+
+/*
+ * Read the attributes and up to len bytes of data of an open variable
+ * in one go: efivarfs files are the attributes followed by the data.
+ */
+static int
+kernel_variable_readv(int fd, uint32_t *attributes, uint32_t *size,
+		      void *buf, uint32_t len)
+{
+	uint32_t attr;
+	struct iovec iov[2] = {
+		{ .iov_base = &attr, .iov_len = sizeof(attr) },
+		{ .iov_base = buf, .iov_len = buf ? len : 0 },
+	};
+	ssize_t ret;
+
+	ret = readv(fd, iov, 2);
+	if (ret < 0)
+		return errno;
+	if (ret < sizeof(attr))
+		return EIO;
+	if (attributes)
+		*attributes = attr;
+	if (size && buf)
+		*size = ret - sizeof(attr);
+	return 0;
 }
 
 int
 get_variable(const char *var, EFI_GUID *guid, uint32_t *attributes,
 	     uint32_t *size, void *buf)
 {
+	struct stat st;
+	int fd, ret = 0;
+
 	if (!kernel_efi_path)
 		return -EINVAL;
 
-	int varfs_len = strlen(var) + 48 + strlen(kernel_efi_path);
-	char *varfs = malloc(varfs_len);
-	uint32_t attr;
-	int fd;
-	struct stat st;
-
-	snprintf(varfs, varfs_len, "%s/%s-%s", kernel_efi_path,
-		 var, guid_to_str(guid));
-	fd = open(varfs, O_RDONLY);
-	free(varfs);
+	fd = kernel_variable_open(var, guid, O_RDONLY);
 	if (fd < 0)
 		return errno;
-	
+	if (fstat(fd, &st) < 0)
+		ret = errno;
+	else if (st.st_size < sizeof(uint32_t))
+		ret = EIO;
+	else if (size)
+		*size = st.st_size - sizeof(uint32_t);
+
+	/* for just the size, the stat will do */
+	if (!ret && (attributes || buf))
+		ret = kernel_variable_readv(fd, attributes, size, buf,
+					   st.st_size - sizeof(uint32_t));
+	close(fd);
+
+	return ret;
+}
+
+/* read the variable open on fd into *buf, growing it as needed */
+static int
+kernel_variable_read_fd(int fd, uint32_t *attributes, uint32_t *size,
+			uint8_t **buf, uint32_t *bufsize)
+{
+	struct stat st;
+	uint32_t len;
+	int ret;
+
 	if (fstat(fd, &st) < 0)
 		return errno;
-	if (size)
-		*size = st.st_size - sizeof(attr);
+	if (st.st_size < sizeof(uint32_t))
+		return EIO;
+	len = st.st_size - sizeof(uint32_t);
+	if (!*buf || *bufsize < len) {
+		uint8_t *newbuf = realloc(*buf, len ? len : 1);
 
-	read(fd, &attr, sizeof(attr));
+		if (!newbuf)
+			return ENOMEM;
+		*buf = newbuf;
+		*bufsize = len;
+	}
+	ret = kernel_variable_readv(fd, attributes, &len, *buf, len);
+	if (!ret && size)
+		*size = len;
+	return ret;
+}
 
-	if (attributes)
-		*attributes = attr;
+/*
+ * Read a variable into *buf, which is (re)allocated if it is smaller
+ * than the *bufsize it had, so a caller reading many variables can keep
+ * passing the same buffer.
+ */
+int
+get_variable_buf(const char *var, EFI_GUID *guid, uint32_t *attributes,
+		 uint32_t *size, uint8_t **buf, uint32_t *bufsize)
+{
+	int fd, ret;
 
-	if (buf)
-		read(fd, buf, st.st_size - sizeof(attr));
+	if (!kernel_efi_path)
+		return -EINVAL;
 
+	fd = kernel_variable_open(var, guid, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	ret = kernel_variable_read_fd(fd, attributes, size, buf, bufsize);
 	close(fd);
+	return ret;
+}
+
+/*
+ * stat() a variable without reading it; efivarfs updates the size and
+ * times of a variable's file whenever it is written.  Returns 0 or an
+ * errno.
+ */
+int
+kernel_variable_stat(const char *var, EFI_GUID *guid, struct stat *st)
+{
+	char *varfs;
+	int ret = 0;
+
+	if (!kernel_efi_path)
+		return -EINVAL;
+
+	varfs = kernel_variable_name(var, guid);
+	if (!varfs)
+		return ENOMEM;
+	if (fstatat(kernel_efi_dir, varfs, st, 0) < 0)
+		ret = errno;
+	free(varfs);
+	return ret;
+}
+
+/* per variable state of a batch read */
+struct batch_slot {
+	char *name;		/* efivarfs file name */
+	int fd;
+	uint64_t size;		/* of the file: attributes and data */
+	struct iovec iov[2];
+};
+
+/* the synchronous path: open, fstat, readv and close each in turn */
+static void
+kernel_variable_batch_sync(struct kernel_variable_req *req,
+			   struct batch_slot *slot, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t bufsize = 0;
+		int fd;
+
+		if (req[i].status)
+			continue;
+		fd = openat(kernel_efi_dir, slot[i].name, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			req[i].status = errno;
+			continue;
+		}
+		req[i].status = kernel_variable_read_fd(fd, &req[i].attributes,
+							&req[i].size,
+							&req[i].data, &bufsize);
+		close(fd);
+	}
+}
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define KERNEL_EFIVARS_URING
+#endif
+#endif
+
+#ifdef KERNEL_EFIVARS_URING
+/*
+ * Firmware variable services can take milliseconds a call, so for many
+ * variables at once the opens, stats, reads and closes go to io_uring
+ * as batches and complete in whatever order the kernel gets to them.
+ * This drives the rings through the raw system calls, so there is no
+ * library to link; anything missing (an old kernel, a seccomp filter,
+ * io_uring_disabled) means the synchronous path is used instead.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+static void
+uring_exit(struct uring *r)
+{
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_len);
+	if (r->sq_ring && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_len);
+	close(r->fd);
+}
+
+/* does the kernel have every operation the batch needs? */
+static int
+uring_probe(struct uring *r)
+{
+	static const int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX,
+				   IORING_OP_READV, IORING_OP_CLOSE };
+	size_t len = sizeof(struct io_uring_probe)
+		+ 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	int i, ok;
+
+	if (!probe)
+		return 0;
+	ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+		     probe, 256) == 0;
+	for (i = 0; ok && i < sizeof(ops)/sizeof(ops[0]); i++)
+		ok = ops[i] <= probe->last_op
+			&& (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+static int
+uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	r->entries = p.sq_entries;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+	r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else
+		r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+	if (r->cq_ring == MAP_FAILED)
+		goto fail;
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+
+	if (!uring_probe(r))
+		goto fail;
+	return 0;
+
+ fail:
+	uring_exit(r);
+	return -1;
+}
+
+typedef void (*uring_prep_fn)(struct io_uring_sqe *sqe, int op, void *arg);
+typedef void (*uring_done_fn)(int op, int res, void *arg);
+
+/*
+ * Run ops operations through the ring, keeping it as full as it will
+ * go; done() sees each result as it completes, in any order.  The CQ
+ * ring is twice the SQ ring, so it can't overflow.
+ */
+static int
+uring_run(struct uring *r, int ops, uring_prep_fn prep, uring_done_fn done,
+	  void *arg)
+{
+	int next = 0, inflight = 0, completed = 0;
+
+	while (completed < ops) {
+		unsigned tail = *r->sq_tail, head;
+		int submit = 0;
+
+		while (next < ops && inflight < r->entries) {
+			unsigned idx = tail & *r->sq_mask;
+			struct io_uring_sqe *sqe = &r->sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			prep(sqe, next, arg);
+			sqe->user_data = next;
+			r->sq_array[idx] = idx;
+			tail++;
+			next++;
+			inflight++;
+			submit++;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+		while (syscall(__NR_io_uring_enter, r->fd, submit, 1,
+			       IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+			if (errno != EINTR)
+				return errno;
+			submit = 0;	/* the kernel has them already */
+		}
+
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+			done(cqe->user_data, cqe->res, arg);
+			head++;
+			inflight--;
+			completed++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+struct uring_batch {
+	struct kernel_variable_req *req;
+	struct batch_slot *slot;
+	struct statx *stx;
+	int *map;		/* op number to req */
+};
+
+/* first pass: open and statx every variable, two ops per req */
+static void
+uring_prep_open(struct io_uring_sqe *sqe, int op, void *arg)
+{
+	struct uring_batch *b = arg;
+	int i = op / 2;
+
+	sqe->fd = kernel_efi_dir;
+	sqe->addr = (uintptr_t)b->slot[i].name;
+	if (op % 2 == 0) {
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	} else {
+		sqe->opcode = IORING_OP_STATX;
+		sqe->len = STATX_SIZE;
+		sqe->off = (uintptr_t)&b->stx[i];
+	}
+}
+
+static void
+uring_done_open(int op, int res, void *arg)
+{
+	struct uring_batch *b = arg;
+	int i = op / 2;
+
+	if (op % 2 == 0)
+		b->slot[i].fd = res;
+	if (res < 0 && !b->req[i].status)
+		b->req[i].status = -res;
+}
+
+/* second pass: one readv of attributes and data per opened variable */
+static void
+uring_prep_read(struct io_uring_sqe *sqe, int op, void *arg)
+{
+	struct uring_batch *b = arg;
+	struct batch_slot *slot = &b->slot[b->map[op]];
+
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = slot->fd;
+	sqe->addr = (uintptr_t)slot->iov;
+	sqe->len = 2;
+	sqe->off = 0;
+}
+
+static void
+uring_done_read(int op, int res, void *arg)
+{
+	struct uring_batch *b = arg;
+	struct kernel_variable_req *req = &b->req[b->map[op]];
+
+	if (res < 0)
+		req->status = -res;
+	else if (res < sizeof(uint32_t))
+		req->status = EIO;
+	else
+		req->size = res - sizeof(uint32_t);
+}
+
+/* last pass: close whatever was opened */
+static void
+uring_prep_close(struct io_uring_sqe *sqe, int op, void *arg)
+{
+	struct uring_batch *b = arg;
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = b->slot[b->map[op]].fd;
+}
+
+static void
+uring_done_close(int op, int res, void *arg)
+{
+	struct uring_batch *b = arg;
+
+	/* whatever res says, the descriptor is gone */
+	b->slot[b->map[op]].fd = -1;
+}
+
+static int
+kernel_variable_batch_uring(struct kernel_variable_req *req,
+			    struct batch_slot *slot, int n)
+{
+	struct uring_batch b = { .req = req, .slot = slot };
+	struct uring r;
+	int i, ops, ret = -1;
+
+	if (uring_init(&r, n < 64 ? 2 * n : 128) < 0)
+		return -1;
+	b.stx = calloc(n, sizeof(*b.stx));
+	b.map = calloc(n, sizeof(*b.map));
+	if (!b.stx || !b.map)
+		goto out;
+
+	if (uring_run(&r, 2 * n, uring_prep_open, uring_done_open, &b))
+		goto out;
+
+	/* everything that opened gets a buffer of exactly its size */
+	for (i = 0, ops = 0; i < n; i++) {
+		if (req[i].status)
+			continue;
+		if (b.stx[i].stx_size < sizeof(uint32_t)) {
+			req[i].status = EIO;
+			continue;
+		}
+		slot[i].size = b.stx[i].stx_size;
+		req[i].data = malloc(slot[i].size - sizeof(uint32_t) + 1);
+		if (!req[i].data) {
+			req[i].status = ENOMEM;
+			continue;
+		}
+		slot[i].iov[0].iov_base = &req[i].attributes;
+		slot[i].iov[0].iov_len = sizeof(uint32_t);
+		slot[i].iov[1].iov_base = req[i].data;
+		slot[i].iov[1].iov_len = slot[i].size - sizeof(uint32_t);
+		b.map[ops++] = i;
+	}
+	if (uring_run(&r, ops, uring_prep_read, uring_done_read, &b))
+		goto out;
+	ret = 0;
+
+ out:
+	if (ret == 0) {
+		for (i = 0, ops = 0; i < n; i++)
+			if (slot[i].fd >= 0)
+				b.map[ops++] = i;
+		/* the reads are done, so a failure here only matters
+		 * for the closes */
+		uring_run(&r, ops, uring_prep_close, uring_done_close, &b);
+	}
+	/*
+	 * A ring that failed may still hold requests, so tear it down
+	 * rather than queue more on it, then close whatever is left
+	 * open by hand.
+	 */
+	uring_exit(&r);
+	for (i = 0; i < n; i++)
+		if (slot[i].fd >= 0) {
+			close(slot[i].fd);
+			slot[i].fd = -1;
+		}
+	free(b.stx);
+	free(b.map);
+	return ret;
+}
+#endif /* KERNEL_EFIVARS_URING */
+
+/*
+ * Read every variable in req, which has var and guid filled in.  Each
+ * gets its status and, on success, its attributes, size and data, which
+ * kernel_variable_batch_free() frees.  Returns non-zero only if the
+ * batch as a whole couldn't be attempted.
+ */
+int
+kernel_variable_read_batch(struct kernel_variable_req *req, int n)
+{
+	struct batch_slot *slot;
+	int i;
+
+	if (!kernel_efi_path)
+		return -EINVAL;
+
+	slot = calloc(n ? n : 1, sizeof(*slot));
+	if (!slot)
+		return ENOMEM;
+	for (i = 0; i < n; i++) {
+		req[i].status = 0;
+		req[i].data = NULL;
+		req[i].size = 0;
+		slot[i].fd = -1;
+		slot[i].name = kernel_variable_name(req[i].var, &req[i].guid);
+		if (!slot[i].name)
+			req[i].status = ENOMEM;
+	}
+#ifdef KERNEL_EFIVARS_URING
+	/* below a few variables a ring isn't worth setting up */
+	if (n < 4 || kernel_variable_batch_uring(req, slot, n) != 0)
+#endif
+	{
+		/* start again from a clean slate */
+		for (i = 0; i < n; i++) {
+			free(req[i].data);
+			req[i].data = NULL;
+			req[i].status = slot[i].name ? 0 : ENOMEM;
+		}
+		kernel_variable_batch_sync(req, slot, n);
+	}
+	for (i = 0; i < n; i++)
+		free(slot[i].name);
+	free(slot);
 
 	return 0;
 }
 
+void
+kernel_variable_batch_free(struct kernel_variable_req *req, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free(req[i].data);
+		req[i].data = NULL;
+	}
+}
+
+/*
+ * Call fn for every variable in the efivarfs, in directory order.  The
+ * directory is scanned once and the variables are read as one batch,
+ * so the data is only good until fn returns.  A non-zero return from
+ * fn stops the walk and is returned; variables that vanish or can't be
+ * read while we walk are skipped.
+ */
 int
-get_variable_alloc(const char *var, EFI_GUID *guid, uint32_t *attributes,
-		   uint32_t *size, uint8_t **buf)
+kernel_variable_for_each(kernel_variable_fn fn, void *arg)
 {
-	uint32_t len;
-	int ret = get_variable(var, guid, NULL, &len, NULL);
-	if (ret)
+	struct kernel_variable_req *req = NULL;
+	struct dirent *de;
+	int fd, i, n = 0, size = 0, ret = 0;
+	DIR *dir;
+
+	if (!kernel_efi_path)
+		return -EINVAL;
+
+	/* an O_PATH fd can't be read, so open the directory properly */
+	fd = openat(kernel_efi_dir, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+	dir = fdopendir(fd);
+	if (!dir) {
+		ret = errno;
+		close(fd);
 		return ret;
+	}
+	while ((de = readdir(dir))) {
+		size_t len = strlen(de->d_name);
+		EFI_GUID guid;
 
-	*buf = malloc(len);
-	if (!buf)
-		return -ENOMEM;
+		/* <name>-<36 character guid> */
+		if (len < 38 || de->d_name[len - 37] != '-'
+		    || str_to_guid(de->d_name + len - 36, &guid))
+			continue;
+		if (n == size) {
+			struct kernel_variable_req *r;
 
-	return get_variable(var, guid, attributes, size, *buf);
+			size = size ? size * 2 : 64;
+			r = realloc(req, size * sizeof(*req));
+			if (!r) {
+				ret = ENOMEM;
+				break;
+			}
+			req = r;
+		}
+		req[n].var = strndup(de->d_name, len - 37);
+		req[n].guid = guid;
+		if (!req[n].var) {
+			ret = ENOMEM;
+			break;
+		}
+		n++;
+	}
+	closedir(dir);
+
+	if (!ret)
+		ret = kernel_variable_read_batch(req, n);
+	for (i = 0; !ret && i < n; i++)
+		if (req[i].status == 0)
+			ret = fn(req[i].var, &req[i].guid, req[i].attributes,
+				 req[i].size, req[i].data, arg);
+	kernel_variable_batch_free(req, n);
+	for (i = 0; i < n; i++)
+		free((char *)req[i].var);
+	free(req);
+
+	return ret;
+}
+
+/*
+ * A set of variables a caller keeps cached, and which of them have been
+ * written, created or deleted since the caller last looked.  This only
+ * sees changes made through the efivarfs mount, which at runtime is
+ * all of them.
+ */
+struct kernel_variable_watch {
+	int fd;			/* inotify */
+	int broken;		/* directory unwatched, trust nothing */
+	int count;
+	struct {
+		char *name;	/* efivarfs file name */
+		int dirty;
+	} *vars;
+};
+
+#define KERNEL_VARIABLE_WATCH_EVENTS \
+	(IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/*
+ * Watch the efivarfs directory, which needn't actually be efivarfs:
+ * any directory set with kernel_variable_set_path() will do.  Returns
+ * NULL with errno set if inotify isn't available.
+ */
+struct kernel_variable_watch *
+kernel_variable_watch_open(void)
+{
+	struct kernel_variable_watch *w;
+	int err;
+
+	if (!kernel_efi_path) {
+		errno = EINVAL;
+		return NULL;
+	}
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd < 0
+	    || inotify_add_watch(w->fd, kernel_efi_path,
+				 KERNEL_VARIABLE_WATCH_EVENTS) < 0) {
+		err = errno;
+		if (w->fd >= 0)
+			close(w->fd);
+		free(w);
+		errno = err;
+		return NULL;
+	}
+	return w;
+}
+
+void
+kernel_variable_watch_close(struct kernel_variable_watch *w)
+{
+	int i;
+
+	if (!w)
+		return;
+	for (i = 0; i < w->count; i++)
+		free(w->vars[i].name);
+	free(w->vars);
+	close(w->fd);
+	free(w);
+}
+
+/*
+ * Start tracking a variable, dirty to begin with since the caller has
+ * nothing cached yet.  Returns its id for kernel_variable_watch_changed()
+ * or -1 if out of memory.
+ */
+int
+kernel_variable_watch_add(struct kernel_variable_watch *w, const char *var,
+			  EFI_GUID *guid)
+{
+	char *name = kernel_variable_name(var, guid);
+	void *vars = realloc(w->vars, (w->count + 1) * sizeof(*w->vars));
+
+	if (!name || !vars) {
+		free(name);
+		if (vars)
+			w->vars = vars;
+		return -1;
+	}
+	w->vars = vars;
+	w->vars[w->count].name = name;
+	w->vars[w->count].dirty = 1;
+	return w->count++;
+}
+
+/* readable, for poll(), when there are events to read */
+int
+kernel_variable_watch_fd(struct kernel_variable_watch *w)
+{
+	return w->fd;
+}
+
+/*
+ * Mark dirty every tracked variable with a pending event, without
+ * waiting for any.  If the kernel lost events, or the directory went
+ * away, everything is marked dirty.  A directory that went away, say
+ * because efivarfs was remounted, is watched again; until that works
+ * every variable counts as changed every time.  Returns 0 or an errno,
+ * which is the one re-adding the watch gave if the watch is broken.
+ */
+int
+kernel_variable_watch_read(struct kernel_variable_watch *w)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int i;
+
+	for (;;) {
+		len = read(w->fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno != EAGAIN)
+			return errno;
+		if (len < 0)
+			break;
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_IGNORED)
+				w->broken = 1;
+			for (i = 0; i < w->count; i++)
+				if ((ev->mask & (IN_Q_OVERFLOW | IN_IGNORED))
+				    || (ev->len
+					&& strcmp(ev->name, w->vars[i].name) == 0))
+					w->vars[i].dirty = 1;
+		}
+	}
+
+	if (w->broken) {
+		if (inotify_add_watch(w->fd, kernel_efi_path,
+				      KERNEL_VARIABLE_WATCH_EVENTS) < 0)
+			return errno;
+		w->broken = 0;
+	}
+	return 0;
+}
+
+/*
+ * Whether variable id has changed since the last call, taking in any
+ * pending events first.  It is clean again once this returns, so read
+ * the variable after calling this, not before: a change in between
+ * then just shows up next time.
+ */
+int
+kernel_variable_watch_changed(struct kernel_variable_watch *w, int id)
+{
+	int dirty;
+
+	if (kernel_variable_watch_read(w) || w->broken)
+		return 1;
+	dirty = w->vars[id].dirty;
+	w->vars[id].dirty = 0;
+	return dirty;
+}
+
+int
+get_variable_alloc(const char *var, EFI_GUID *guid, uint32_t *attributes,
+		   uint32_t *size, uint8_t **buf)
+{
+	uint32_t bufsize = 0;
+
+	*buf = NULL;
+	return get_variable_buf(var, guid, attributes, size, buf, &bufsize);
 }
 
 int
@@ -153,34 +976,67 @@ variable_is_secureboot(void)
 	return secure_boot;
 }
 
+/*
+ * efivarfs takes an update as a single write of the attributes followed
+ * by the data; it has no write_iter, so a writev() would reach it as
+ * one write per iovec.  The attributes therefore have to sit in front of
+ * the data in one buffer.
+ */
+static int
+kernel_variable_write(const char *var, EFI_GUID *guid, void *data,
+		      uint32_t len)
+{
+	int fd, ret = 0;
+
+	fd = kernel_variable_open(var, guid, O_RDWR|O_CREAT|O_TRUNC);
+	if (fd < 0)
+		return errno;
+	if (write(fd, data, len) != len)
+		ret = errno;
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Like set_variable(), but the KERNEL_VARIABLE_HEADROOM bytes before buf
+ * are the caller's and take the attributes, which saves copying the data
+ */
 int
-set_variable(const char *var, EFI_GUID *guid, uint32_t attributes,
-	     uint32_t size, void *buf)
+set_variable_headroom(const char *var, EFI_GUID *guid, uint32_t attributes,
+		      uint32_t size, void *buf)
 {
+	uint8_t *data = (uint8_t *)buf - KERNEL_VARIABLE_HEADROOM;
+
 	if (!kernel_efi_path)
 		return -EINVAL;
 
-	int varfs_len = strlen(var) + 48 + strlen(kernel_efi_path);
-	char *varfs = malloc(varfs_len),
-		*newbuf = malloc(size + sizeof(attributes));
-	int fd;
+	memcpy(data, &attributes, sizeof(attributes));
+	return kernel_variable_write(var, guid, data,
+				     size + KERNEL_VARIABLE_HEADROOM);
+}
 
-	snprintf(varfs, varfs_len, "%s/%s-%s", kernel_efi_path,
-		 var, guid_to_str(guid));
-	fd = open(varfs, O_RDWR|O_CREAT|O_TRUNC, 0644);
-	free(varfs);
-	if (fd < 0)
-		return errno;
-	memcpy(newbuf, &attributes, sizeof(attributes));
-	memcpy(newbuf + sizeof(attributes), buf, size);
-	
-	if (write(fd, newbuf, size + sizeof(attributes)) != size + sizeof(attributes))
-		return errno;
+int
+set_variable(const char *var, EFI_GUID *guid, uint32_t attributes,
+	     uint32_t size, void *buf)
+{
+	uint8_t *newbuf;
+	int ret;
 
-	close(fd);
+	if (!kernel_efi_path)
+		return -EINVAL;
 
-	return 0;
+	newbuf = malloc(size + KERNEL_VARIABLE_HEADROOM);
+	if (!newbuf)
+		return ENOMEM;
+	memcpy(newbuf + KERNEL_VARIABLE_HEADROOM, buf, size);
+	ret = set_variable_headroom(var, guid, attributes, size,
+				    newbuf + KERNEL_VARIABLE_HEADROOM);
+	free(newbuf);
+
+	return ret;
 }
+
 int
 set_variable_esl(const char *var, EFI_GUID *guid, uint32_t attributes,
 		 uint32_t size, void *buf)
@@ -189,12 +1045,16 @@ set_variable_esl(const char *var, EFI_GUID *guid, uint32_t attributes,
 		return -EINVAL;
 
 	int newsize = size + OFFSET_OF(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo) + OFFSET_OF(WIN_CERTIFICATE_UEFI_GUID, CertData);
-	char *newdata = malloc(newsize);
+	char *alloc = malloc(KERNEL_VARIABLE_HEADROOM + newsize);
+	char *newdata = alloc + KERNEL_VARIABLE_HEADROOM;
 	EFI_VARIABLE_AUTHENTICATION_2 *DescriptorData;
 	EFI_TIME *Time;
 	struct tm tm;
 	time_t t;
 
+	if (!alloc)
+		return ENOMEM;
+
 	time(&t);
 
 	memset(newdata, '\0', newsize);
@@ -215,8 +1075,8 @@ set_variable_esl(const char *var, EFI_GUID *guid, uint32_t attributes,
 	DescriptorData->AuthInfo.Hdr.wCertificateType = WIN_CERT_TYPE_EFI_GUID;
 	DescriptorData->AuthInfo.CertType =  EFI_CERT_TYPE_PKCS7_GUID;
 
-	int ret = set_variable(var, guid, attributes, newsize, newdata);
-	free(newdata);
+	int ret = set_variable_headroom(var, guid, attributes, newsize, newdata);
+	free(alloc);
 	return ret;
 }
 
@@ -298,10 +298,13 @@ pecoff_check_mok(EFI_HANDLE image, CHAR16 *name)
 	if (status != EFI_SUCCESS)
 		return status;
 
-	if (find_in_variable_esl(L"dbx", SIG_DB, hash, SHA256_DIGEST_SIZE)
-	    == EFI_SUCCESS)
+	status = find_in_variable_esl(L"dbx", SIG_DB, hash, SHA256_DIGEST_SIZE);
+	if (status == EFI_SUCCESS)
 		/* MOK list cannot override dbx */
 		goto check_tmplist;
+	if (status != EFI_NOT_FOUND)
+		/* can't tell whether it's revoked, so assume it is */
+		return EFI_SECURITY_VIOLATION;
 
 	status = get_variable_attr(L"MokList", &data, &len, MOK_OWNER, &attr);
 	if (status != EFI_SUCCESS)
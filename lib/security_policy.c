@@ -50,15 +50,148 @@ struct _EFI_SECURITY_PROTOCOL {
 
 static UINT8 *security_policy_esl = NULL;
 static UINTN security_policy_esl_len;
+static esl_index security_policy_index;
+
+/*
+ * A variable as last read: the indexes below are only rebuilt when a
+ * read gives something different.
+ */
+struct security_policy_var {
+	int valid;
+	UINT8 *data;
+	UINTN len;
+	UINT32 attr;
+};
+
+/*
+ * The parsed forms of the variables the MOK check depends on.  Every
+ * image a chainloaded loader starts goes through the check, and
+ * anything it starts (KeyTool, HashTool) may have changed dbx or
+ * MokList since the last one, so each check still reads both, but it
+ * only parses them again when they have changed.
+ */
+static struct {
+	struct security_policy_var dbx_var, moklist_var;
+	esl_index dbx;
+	esl_bloom dbx_bloom;	/* nearly every image is not in dbx */
+	esl_index moklist;	/* empty unless boot services only */
+} security_policy_cache;
+
+static void
+security_policy_var_free(struct security_policy_var *v)
+{
+	if (v->data)
+		FreePool(v->data);
+	ZeroMem(v, sizeof(*v));
+}
+
+static void
+security_policy_cache_flush(void)
+{
+	security_policy_var_free(&security_policy_cache.dbx_var);
+	security_policy_var_free(&security_policy_cache.moklist_var);
+	esl_index_free(&security_policy_cache.dbx);
+	esl_bloom_free(&security_policy_cache.dbx_bloom);
+	esl_index_free(&security_policy_cache.moklist);
+}
+
+/*
+ * Read variable var into v, setting *changed if it differs from what v
+ * held before.  A variable that doesn't exist reads as empty.
+ */
+static EFI_STATUS
+security_policy_var_read(struct security_policy_var *v, CHAR16 *var,
+			 EFI_GUID owner, int *changed)
+{
+	EFI_STATUS status;
+	UINT8 *data = NULL;
+	UINTN len;
+	UINT32 attr = 0;
+
+	status = get_variable_attr(var, &data, &len, owner, &attr);
+	if (status == EFI_NOT_FOUND) {
+		data = NULL;
+		len = 0;
+	} else if (status != EFI_SUCCESS) {
+		return status;
+	}
+
+	*changed = !v->valid || v->len != len || v->attr != attr
+		|| (len && CompareMem(v->data, data, len) != 0);
+	if (!*changed) {
+		if (data)
+			FreePool(data);
+		return EFI_SUCCESS;
+	}
+
+	security_policy_var_free(v);
+	v->valid = 1;
+	v->data = data;
+	v->len = len;
+	v->attr = attr;
+	return EFI_SUCCESS;
+}
+
+/* bring the parsed dbx and MokList up to date with the variables */
+static EFI_STATUS
+security_policy_cache_update(void)
+{
+	struct security_policy_var *v;
+	EFI_STATUS status;
+	int changed;
+
+	v = &security_policy_cache.dbx_var;
+	status = security_policy_var_read(v, L"dbx", SIG_DB, &changed);
+	if (status != EFI_SUCCESS)
+		goto err;
+	if (changed) {
+		esl_index_free(&security_policy_cache.dbx);
+		esl_bloom_free(&security_policy_cache.dbx_bloom);
+		status = esl_index_build(&security_policy_cache.dbx, v->data,
+					 v->len, SHA256_DIGEST_SIZE);
+		if (status == EFI_SUCCESS)
+			status = esl_bloom_build(&security_policy_cache.dbx_bloom,
+						 v->data, v->len,
+						 SHA256_DIGEST_SIZE);
+		if (status != EFI_SUCCESS)
+			goto err;
+	}
+
+	v = &security_policy_cache.moklist_var;
+	status = security_policy_var_read(v, L"MokList", MOK_OWNER, &changed);
+	if (status != EFI_SUCCESS) {
+		/* an unreadable MokList just vouches for nothing */
+		security_policy_var_free(v);
+		esl_index_free(&security_policy_cache.moklist);
+		return EFI_SUCCESS;
+	}
+	if (changed) {
+		esl_index_free(&security_policy_cache.moklist);
+		/* a MokList anyone can write to at runtime can't be trusted */
+		if ((v->attr & EFI_VARIABLE_RUNTIME_ACCESS) == 0)
+			status = esl_index_build(&security_policy_cache.moklist,
+						 v->data, v->len,
+						 SHA256_DIGEST_SIZE);
+		if (status != EFI_SUCCESS)
+			goto err;
+	}
+
+	return EFI_SUCCESS;
+
+ err:
+	/* start from scratch next time */
+	security_policy_cache_flush();
+	return status;
+}
 
 static EFI_STATUS
 security_policy_check_mok(void *data, UINTN len)
 {
 	EFI_STATUS status;
 	UINT8 hash[SHA256_DIGEST_SIZE];
-	UINT32 attr;
 	UINT8 *VarData;
 	UINTN VarLen;
+	UINT32 attr;
 
 	/* first check is MokSBState.  If we're in insecure mode, boot
 	 * anyway regardless of dbx contents */
@@ -73,32 +206,25 @@ security_policy_check_mok(void *data, UINTN len)
 			return EFI_SUCCESS;
 	}
 
+	/* a dbx we can't read might revoke anything */
+	status = security_policy_cache_update();
+	if (status != EFI_SUCCESS)
+		return status;
+
 	status = sha256_get_pecoff_digest_mem(data, len, hash);
 	if (status != EFI_SUCCESS)
 		return status;
 
-	if (find_in_variable_esl(L"dbx", SIG_DB, hash, SHA256_DIGEST_SIZE)
-	    == EFI_SUCCESS)
+	if (esl_bloom_find(&security_policy_cache.dbx_bloom, hash) == EFI_SUCCESS
+	    && esl_index_find(&security_policy_cache.dbx, hash) == EFI_SUCCESS)
 		/* MOK list cannot override dbx */
 		return EFI_SECURITY_VIOLATION;
 
-	status = get_variable_attr(L"MokList", &VarData, &VarLen, MOK_OWNER,
-				   &attr);
-	if (status != EFI_SUCCESS)
-		goto check_tmplist;
-
-	FreePool(VarData);
-
-	if (attr & EFI_VARIABLE_RUNTIME_ACCESS)
-		goto check_tmplist;
-
-	if (find_in_variable_esl(L"MokList", MOK_OWNER, hash, SHA256_DIGEST_SIZE) == EFI_SUCCESS)
+	if (esl_index_find(&security_policy_cache.moklist, hash) == EFI_SUCCESS)
 		return EFI_SUCCESS;
 
- check_tmplist:
 	if (security_policy_esl
-	    && find_in_esl(security_policy_esl, security_policy_esl_len, hash,
-			   SHA256_DIGEST_SIZE) == EFI_SUCCESS)
+	    && esl_index_find(&security_policy_index, hash) == EFI_SUCCESS)
 		return EFI_SUCCESS;
 
 	return EFI_SECURITY_VIOLATION;
@@ -349,6 +475,9 @@ security_policy_install(void)
 	    !=  thunk_security_policy_authentication)
 		return EFI_ACCESS_DENIED;
 
+	/* a failure here just means the check will try again later */
+	security_policy_cache_update();
+
 	return EFI_SUCCESS;
 }
 
@@ -388,6 +517,8 @@ security_policy_uninstall(void)
 		es2fa = NULL;
 	}
 
+	security_policy_cache_flush();
+
 	return EFI_SUCCESS;
 }
 
@@ -396,4 +527,10 @@ security_protocol_set_hashes(unsigned char *esl, int len)
 {
 	security_policy_esl = esl;
 	security_policy_esl_len = len;
+
+	/* the list is checked for every image, so index it once here */
+	esl_index_free(&security_policy_index);
+	if (esl && esl_index_build(&security_policy_index, esl, len,
+				   SHA256_DIGEST_SIZE) != EFI_SUCCESS)
+		security_policy_esl = NULL;
 }
@@ -27,6 +27,10 @@
 
 #ifndef BUILD_EFI
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #define Print(...) printf("%ls", __VA_ARGS__)
 #define AllocatePool(x) malloc(x)
 #define CopyMem(d, s, l) memcpy(d, s, l)
@@ -50,8 +54,24 @@
     (b)[(i) + 3] = (uint8) ( (n)       );       \
 }
 
+typedef void (*sha256_block_fn)( sha256_context *ctx, const uint8 *data,
+                                 uint32 blocks );
+
+/* the block compression function, chosen once from the CPU features */
+static sha256_block_fn sha256_block = NULL;
+
+/* the multi-buffer block function, if the CPU makes one worthwhile */
+typedef void (*sha256_block_mb_fn)( uint32 *state[], const uint8 *data[],
+                                    uint32 blocks );
+static sha256_block_mb_fn sha256_block_mb = NULL;
+
+static void sha256_select_block( void );
+
 void sha256_starts( sha256_context *ctx )
 {
+    if( ! sha256_block )
+        sha256_select_block();
+
     ctx->total[0] = 0;
     ctx->total[1] = 0;
 
@@ -196,36 +216,467 @@ void sha256_process( sha256_context *ctx, uint8 data[64] )
     ctx->state[7] += H;
 }
 
-void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
+static void sha256_block_generic( sha256_context *ctx, const uint8 *data,
+                                  uint32 blocks )
 {
-    uint32 left, fill;
+    while( blocks-- )
+    {
+        sha256_process( ctx, (uint8 *) data );
+        data += 64;
+    }
+}
 
-    if( ! length ) return;
+#if defined(__x86_64__)
+/*
+ * x86_64 has three accelerated block functions, picked via CPUID:
+ *
+ *  - SHA-NI: the SHA256RNDS2/SHA256MSG1/SHA256MSG2 instructions do the
+ *    whole compression in XMM registers.
+ *  - AVX2: the message schedule for two consecutive blocks is computed
+ *    together (one block per 128-bit lane) and the rounds are scalar.
+ *    This is only used outside of EFI since firmware is not required to
+ *    enable (or preserve) the YMM state.
+ *  - SSSE3: as AVX2, but one block at a time.
+ *
+ * SSE is always enabled in x86_64 UEFI, so the first and last may be used
+ * by the EFI binaries too.
+ */
+#include <cpuid.h>
+#include <immintrin.h>
 
-    left = ctx->total[0] & 0x3F;
-    fill = 64 - left;
+static const uint32 sha256_k[64] __attribute__((aligned(16))) =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+    0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+    0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+    0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+    0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+    0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+/* the 64 rounds over a precomputed W[t] + K[t] schedule */
+static inline void sha256_rounds( uint32 state[8], const uint32 WK[64] )
+{
+    uint32 temp1, temp2;
+    uint32 A, B, C, D, E, F, G, H;
+    int t;
+
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+    F = state[5];
+    G = state[6];
+    H = state[7];
+
+    for( t = 0; t < 64; t += 8 )
+    {
+        P( A, B, C, D, E, F, G, H, WK[t    ], 0 );
+        P( H, A, B, C, D, E, F, G, WK[t + 1], 0 );
+        P( G, H, A, B, C, D, E, F, WK[t + 2], 0 );
+        P( F, G, H, A, B, C, D, E, WK[t + 3], 0 );
+        P( E, F, G, H, A, B, C, D, WK[t + 4], 0 );
+        P( D, E, F, G, H, A, B, C, WK[t + 5], 0 );
+        P( C, D, E, F, G, H, A, B, WK[t + 6], 0 );
+        P( B, C, D, E, F, G, H, A, WK[t + 7], 0 );
+    }
+
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+    state[5] += F;
+    state[6] += G;
+    state[7] += H;
+}
+
+#define SSE_ROTR(x,n) \
+    _mm_or_si128( _mm_srli_epi32( x, n ), _mm_slli_epi32( x, 32 - n ) )
+#define SSE_S0(x) _mm_xor_si128( _mm_xor_si128( SSE_ROTR(x, 7),   \
+                  SSE_ROTR(x,18) ), _mm_srli_epi32( x, 3 ) )
+#define SSE_S1(x) _mm_xor_si128( _mm_xor_si128( SSE_ROTR(x,17),   \
+                  SSE_ROTR(x,19) ), _mm_srli_epi32( x,10 ) )
+
+/*
+ * W[t..t+3] from X0 = W[t-16..t-13] ... X3 = W[t-4..t-1].  S1 needs
+ * W[t-2..t+1], so it is applied in two halves: first to W[t-2], W[t-1]
+ * (top of X3) to get W[t], W[t+1], then to those.  S1(0) is 0, which
+ * keeps the unused lanes clean.
+ */
+#define SSE_SCHEDULE(X0,X1,X2,X3,T)                                     \
+{                                                                       \
+    T = _mm_add_epi32( _mm_add_epi32( X0,                               \
+            SSE_S0( _mm_alignr_epi8( X1, X0, 4 ) ) ),                   \
+            _mm_alignr_epi8( X3, X2, 4 ) );                             \
+    T = _mm_add_epi32( T, SSE_S1( _mm_srli_si128( X3, 8 ) ) );          \
+    T = _mm_add_epi32( T, SSE_S1( _mm_slli_si128( T, 8 ) ) );           \
+}
+
+static void __attribute__((target("ssse3")))
+sha256_block_ssse3( sha256_context *ctx, const uint8 *data, uint32 blocks )
+{
+    const __m128i bswap = _mm_set_epi64x( 0x0C0D0E0F08090A0BULL,
+                                          0x0405060700010203ULL );
+    uint32 WK[64] __attribute__((aligned(16)));
+    __m128i X0, X1, X2, X3, X4;
+    int t;
+
+    while( blocks-- )
+    {
+        X0 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data     ) ), bswap );
+        X1 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 16) ), bswap );
+        X2 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 32) ), bswap );
+        X3 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 48) ), bswap );
+
+#define SSE_STORE_WK(X,t) \
+        _mm_store_si128( (__m128i *) &WK[t], \
+                         _mm_add_epi32( X, _mm_load_si128( (const __m128i *) &sha256_k[t] ) ) )
+
+        SSE_STORE_WK( X0,  0 );
+        SSE_STORE_WK( X1,  4 );
+        SSE_STORE_WK( X2,  8 );
+        SSE_STORE_WK( X3, 12 );
+
+        for( t = 16; t < 64; t += 4 )
+        {
+            SSE_SCHEDULE( X0, X1, X2, X3, X4 );
+            SSE_STORE_WK( X4, t );
+            X0 = X1; X1 = X2; X2 = X3; X3 = X4;
+        }
+#undef SSE_STORE_WK
+
+        sha256_rounds( ctx->state, WK );
+        data += 64;
+    }
+}
+
+#ifndef BUILD_EFI
+#define AVX_ROTR(x,n) \
+    _mm256_or_si256( _mm256_srli_epi32( x, n ), _mm256_slli_epi32( x, 32 - n ) )
+#define AVX_S0(x) _mm256_xor_si256( _mm256_xor_si256( AVX_ROTR(x, 7), \
+                  AVX_ROTR(x,18) ), _mm256_srli_epi32( x, 3 ) )
+#define AVX_S1(x) _mm256_xor_si256( _mm256_xor_si256( AVX_ROTR(x,17), \
+                  AVX_ROTR(x,19) ), _mm256_srli_epi32( x,10 ) )
 
+/* as SSE_SCHEDULE, the byte shifts and alignr work per 128-bit lane */
+#define AVX_SCHEDULE(X0,X1,X2,X3,T)                                     \
+{                                                                       \
+    T = _mm256_add_epi32( _mm256_add_epi32( X0,                         \
+            AVX_S0( _mm256_alignr_epi8( X1, X0, 4 ) ) ),                \
+            _mm256_alignr_epi8( X3, X2, 4 ) );                          \
+    T = _mm256_add_epi32( T, AVX_S1( _mm256_srli_si256( X3, 8 ) ) );    \
+    T = _mm256_add_epi32( T, AVX_S1( _mm256_slli_si256( T, 8 ) ) );     \
+}
+
+static void __attribute__((target("avx2")))
+sha256_block_avx2( sha256_context *ctx, const uint8 *data, uint32 blocks )
+{
+    const __m256i bswap = _mm256_set_epi64x( 0x0C0D0E0F08090A0BULL,
+                                             0x0405060700010203ULL,
+                                             0x0C0D0E0F08090A0BULL,
+                                             0x0405060700010203ULL );
+    uint32 WK0[64] __attribute__((aligned(16)));
+    uint32 WK1[64] __attribute__((aligned(16)));
+    __m256i X0, X1, X2, X3, X4;
+    int t;
+
+    for( ; blocks >= 2; blocks -= 2, data += 128 )
+    {
+#define AVX_LOAD(i)                                                     \
+        _mm256_shuffle_epi8( _mm256_inserti128_si256(                   \
+            _mm256_castsi128_si256(                                     \
+                _mm_loadu_si128( (const __m128i *) (data + (i)) ) ),    \
+            _mm_loadu_si128( (const __m128i *) (data + 64 + (i)) ), 1 ), \
+            bswap )
+#define AVX_STORE_WK(X,t)                                               \
+        {                                                               \
+            __m256i wk = _mm256_add_epi32( X, _mm256_broadcastsi128_si256( \
+                _mm_load_si128( (const __m128i *) &sha256_k[t] ) ) );   \
+            _mm_store_si128( (__m128i *) &WK0[t],                       \
+                             _mm256_castsi256_si128( wk ) );            \
+            _mm_store_si128( (__m128i *) &WK1[t],                       \
+                             _mm256_extracti128_si256( wk, 1 ) );       \
+        }
+
+        X0 = AVX_LOAD(  0 );
+        X1 = AVX_LOAD( 16 );
+        X2 = AVX_LOAD( 32 );
+        X3 = AVX_LOAD( 48 );
+
+        AVX_STORE_WK( X0,  0 );
+        AVX_STORE_WK( X1,  4 );
+        AVX_STORE_WK( X2,  8 );
+        AVX_STORE_WK( X3, 12 );
+
+        for( t = 16; t < 64; t += 4 )
+        {
+            AVX_SCHEDULE( X0, X1, X2, X3, X4 );
+            AVX_STORE_WK( X4, t );
+            X0 = X1; X1 = X2; X2 = X3; X3 = X4;
+        }
+#undef AVX_LOAD
+#undef AVX_STORE_WK
+
+        sha256_rounds( ctx->state, WK0 );
+        sha256_rounds( ctx->state, WK1 );
+    }
+
+    if( blocks )
+        sha256_block_ssse3( ctx, data, blocks );
+}
+
+#define AVX_S2(x) _mm256_xor_si256( _mm256_xor_si256( AVX_ROTR(x, 2), \
+                  AVX_ROTR(x,13) ), AVX_ROTR(x,22) )
+#define AVX_S3(x) _mm256_xor_si256( _mm256_xor_si256( AVX_ROTR(x, 6), \
+                  AVX_ROTR(x,11) ), AVX_ROTR(x,25) )
+#define AVX_F0(x,y,z) _mm256_or_si256( _mm256_and_si256( x, y ),      \
+                      _mm256_and_si256( z, _mm256_or_si256( x, y ) ) )
+#define AVX_F1(x,y,z) _mm256_xor_si256( z,                            \
+                      _mm256_and_si256( x, _mm256_xor_si256( y, z ) ) )
+
+/*
+ * Eight independent messages at once, one per 32-bit lane: S[j] holds
+ * state word j of every message.  All lanes compress the same number of
+ * blocks; an unused lane has NULL data and its state is garbage after.
+ */
+static void __attribute__((target("avx2")))
+sha256_block_mb8( uint32 *state[], const uint8 *data[], uint32 blocks )
+{
+    uint32 tmp[16][SHA256_MB_LANES] __attribute__((aligned(32)));
+    const uint8 *in[SHA256_MB_LANES];
+    __m256i S[8], V[8], W[16], temp1, temp2;
+    int i, j, t;
+
+    ZeroMem( tmp, sizeof( tmp ) );
+    for( j = 0; j < 8; j++ )
+    {
+        for( i = 0; i < SHA256_MB_LANES; i++ )
+            tmp[j][i] = state[i][j];
+        S[j] = _mm256_load_si256( (const __m256i *) tmp[j] );
+    }
+    for( i = 0; i < SHA256_MB_LANES; i++ )
+        in[i] = data[i];
+
+    while( blocks-- )
+    {
+        for( i = 0; i < SHA256_MB_LANES; i++ )
+        {
+            if( ! in[i] )
+                continue;
+            for( t = 0; t < 16; t++ )
+                GET_UINT32( tmp[t][i], in[i], 4 * t );
+            in[i] += 64;
+        }
+
+        for( j = 0; j < 8; j++ )
+            V[j] = S[j];
+
+        for( t = 0; t < 64; t++ )
+        {
+            if( t < 16 )
+                W[t] = _mm256_load_si256( (const __m256i *) tmp[t] );
+            else
+                W[t & 15] = _mm256_add_epi32(
+                    _mm256_add_epi32( AVX_S1( W[(t -  2) & 15] ),
+                                      W[(t -  7) & 15] ),
+                    _mm256_add_epi32( AVX_S0( W[(t - 15) & 15] ),
+                                      W[t & 15] ) );
+
+            temp1 = _mm256_add_epi32(
+                _mm256_add_epi32( V[7], AVX_S3( V[4] ) ),
+                _mm256_add_epi32( AVX_F1( V[4], V[5], V[6] ),
+                    _mm256_add_epi32( W[t & 15],
+                        _mm256_set1_epi32( (int) sha256_k[t] ) ) ) );
+            temp2 = _mm256_add_epi32( AVX_S2( V[0] ),
+                                      AVX_F0( V[0], V[1], V[2] ) );
+
+            V[7] = V[6];
+            V[6] = V[5];
+            V[5] = V[4];
+            V[4] = _mm256_add_epi32( V[3], temp1 );
+            V[3] = V[2];
+            V[2] = V[1];
+            V[1] = V[0];
+            V[0] = _mm256_add_epi32( temp1, temp2 );
+        }
+
+        for( j = 0; j < 8; j++ )
+            S[j] = _mm256_add_epi32( S[j], V[j] );
+    }
+
+    for( j = 0; j < 8; j++ )
+    {
+        _mm256_store_si256( (__m256i *) tmp[j], S[j] );
+        for( i = 0; i < SHA256_MB_LANES; i++ )
+            state[i][j] = tmp[j][i];
+    }
+}
+#endif /* BUILD_EFI */
+
+/*
+ * Four rounds with SHA-NI.  Mi holds W[4i..4i+3]; from i = 4 on it is
+ * computed in place from the previous four message vectors.
+ */
+#define SHANI_ROUNDS(i,M0,M1,M2,M3)                                     \
+{                                                                       \
+    if( i >= 4 )                                                        \
+        M0 = _mm_sha256msg2_epu32( _mm_add_epi32(                       \
+                 _mm_sha256msg1_epu32( M0, M1 ),                        \
+                 _mm_alignr_epi8( M3, M2, 4 ) ), M3 );                  \
+    MSG = _mm_add_epi32( M0,                                            \
+              _mm_load_si128( (const __m128i *) &sha256_k[4 * (i)] ) ); \
+    STATE1 = _mm_sha256rnds2_epu32( STATE1, STATE0, MSG );              \
+    MSG = _mm_shuffle_epi32( MSG, 0x0E );                               \
+    STATE0 = _mm_sha256rnds2_epu32( STATE0, STATE1, MSG );              \
+}
+
+static void __attribute__((target("sha,sse4.1,ssse3")))
+sha256_block_shani( sha256_context *ctx, const uint8 *data, uint32 blocks )
+{
+    const __m128i bswap = _mm_set_epi64x( 0x0C0D0E0F08090A0BULL,
+                                          0x0405060700010203ULL );
+    __m128i STATE0, STATE1, ABEF, CDGH, MSG, TMP;
+    __m128i M0, M1, M2, M3;
+
+    /* the instructions want the state as ABEF/CDGH */
+    TMP    = _mm_loadu_si128( (const __m128i *) &ctx->state[0] );
+    STATE1 = _mm_loadu_si128( (const __m128i *) &ctx->state[4] );
+    TMP    = _mm_shuffle_epi32( TMP, 0xB1 );
+    STATE1 = _mm_shuffle_epi32( STATE1, 0x1B );
+    STATE0 = _mm_alignr_epi8( TMP, STATE1, 8 );
+    STATE1 = _mm_blend_epi16( STATE1, TMP, 0xF0 );
+
+    while( blocks-- )
+    {
+        ABEF = STATE0;
+        CDGH = STATE1;
+
+        M0 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data     ) ), bswap );
+        M1 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 16) ), bswap );
+        M2 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 32) ), bswap );
+        M3 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 48) ), bswap );
+
+        SHANI_ROUNDS(  0, M0, M1, M2, M3 );
+        SHANI_ROUNDS(  1, M1, M2, M3, M0 );
+        SHANI_ROUNDS(  2, M2, M3, M0, M1 );
+        SHANI_ROUNDS(  3, M3, M0, M1, M2 );
+        SHANI_ROUNDS(  4, M0, M1, M2, M3 );
+        SHANI_ROUNDS(  5, M1, M2, M3, M0 );
+        SHANI_ROUNDS(  6, M2, M3, M0, M1 );
+        SHANI_ROUNDS(  7, M3, M0, M1, M2 );
+        SHANI_ROUNDS(  8, M0, M1, M2, M3 );
+        SHANI_ROUNDS(  9, M1, M2, M3, M0 );
+        SHANI_ROUNDS( 10, M2, M3, M0, M1 );
+        SHANI_ROUNDS( 11, M3, M0, M1, M2 );
+        SHANI_ROUNDS( 12, M0, M1, M2, M3 );
+        SHANI_ROUNDS( 13, M1, M2, M3, M0 );
+        SHANI_ROUNDS( 14, M2, M3, M0, M1 );
+        SHANI_ROUNDS( 15, M3, M0, M1, M2 );
+
+        STATE0 = _mm_add_epi32( STATE0, ABEF );
+        STATE1 = _mm_add_epi32( STATE1, CDGH );
+        data += 64;
+    }
+
+    /* and back to ABCD/EFGH */
+    TMP    = _mm_shuffle_epi32( STATE0, 0x1B );
+    STATE1 = _mm_shuffle_epi32( STATE1, 0xB1 );
+    STATE0 = _mm_blend_epi16( TMP, STATE1, 0xF0 );
+    STATE1 = _mm_alignr_epi8( STATE1, TMP, 8 );
+
+    _mm_storeu_si128( (__m128i *) &ctx->state[0], STATE0 );
+    _mm_storeu_si128( (__m128i *) &ctx->state[4], STATE1 );
+}
+
+static void sha256_select_block( void )
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int ecx1;
+
+    sha256_block = sha256_block_generic;
+
+    if( ! __get_cpuid( 1, &eax, &ebx, &ecx1, &edx ) )
+        return;
+    if( ! __get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) )
+        ebx = 0;
+
+    if( ( ebx & bit_SHA ) && ( ecx1 & bit_SSE4_1 ) && ( ecx1 & bit_SSSE3 ) )
+    {
+        sha256_block = sha256_block_shani;
+        return;
+    }
+#ifndef BUILD_EFI
+    /* AVX2 also needs the OS to have enabled the YMM state in XCR0 */
+    if( ( ebx & bit_AVX2 ) && ( ecx1 & bit_OSXSAVE ) && ( ecx1 & bit_AVX ) )
+    {
+        unsigned int xcr0_lo, xcr0_hi;
+
+        __asm__ ( "xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0) );
+        if( ( xcr0_lo & 0x6 ) == 0x6 )
+        {
+            sha256_block = sha256_block_avx2;
+            sha256_block_mb = sha256_block_mb8;
+            return;
+        }
+    }
+#endif
+    if( ecx1 & bit_SSSE3 )
+        sha256_block = sha256_block_ssse3;
+}
+#else
+static void sha256_select_block( void )
+{
+    sha256_block = sha256_block_generic;
+}
+#endif /* __x86_64__ */
+
+static void sha256_add_length( sha256_context *ctx, uint32 length )
+{
     ctx->total[0] += length;
     ctx->total[0] &= 0xFFFFFFFF;
 
     if( ctx->total[0] < length )
         ctx->total[1]++;
+}
+
+void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
+{
+    uint32 left, fill;
+
+    if( ! length ) return;
+
+    left = ctx->total[0] & 0x3F;
+    fill = 64 - left;
+
+    sha256_add_length( ctx, length );
 
     if( left && length >= fill )
     {
         CopyMem( (void *) (ctx->buffer + left),
                 (void *) input, fill );
-        sha256_process( ctx, ctx->buffer );
+        sha256_block( ctx, ctx->buffer, 1 );
         length -= fill;
         input  += fill;
         left = 0;
     }
 
-    while( length >= 64 )
+    if( length >= 64 )
     {
-        sha256_process( ctx, input );
-        length -= 64;
-        input  += 64;
+        sha256_block( ctx, input, length >> 6 );
+        input  += length & ~0x3F;
+        length &= 0x3F;
     }
 
     if( length )
@@ -235,6 +686,111 @@ void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
     }
 }
 
+/* below this many busy lanes the single buffer code is faster */
+#define SHA256_MB_MIN_LANES 3
+
+static void sha256_update_mb( sha256_context *ctx[], uint8 *input[],
+                              uint32 length[], int n )
+{
+    uint32 idle_state[8];
+    uint32 *state[SHA256_MB_LANES];
+    const uint8 *data[SHA256_MB_LANES], *lane[SHA256_MB_LANES];
+    uint32 blocks[SHA256_MB_LANES], tail[SHA256_MB_LANES];
+    uint32 head, min;
+    int i, busy;
+
+    for( i = 0; i < n; i++ )
+    {
+        /* top up the partial block, leaving the buffer empty */
+        head = ( 64 - ( ctx[i]->total[0] & 0x3F ) ) & 0x3F;
+        if( head > length[i] )
+            head = length[i];
+        sha256_update( ctx[i], input[i], head );
+
+        data[i]   = input[i] + head;
+        blocks[i] = ( length[i] - head ) >> 6;
+        tail[i]   = ( length[i] - head ) & 0x3F;
+        sha256_add_length( ctx[i], blocks[i] << 6 );
+    }
+
+    for( ;; )
+    {
+        busy = 0;
+        min = 0;
+        for( i = 0; i < n; i++ )
+        {
+            if( ! blocks[i] )
+                continue;
+            if( ! busy++ || blocks[i] < min )
+                min = blocks[i];
+        }
+        if( busy < SHA256_MB_MIN_LANES )
+            break;
+
+        for( i = 0; i < SHA256_MB_LANES; i++ )
+        {
+            if( i < n && blocks[i] )
+            {
+                state[i] = ctx[i]->state;
+                lane[i]  = data[i];
+            }
+            else
+            {
+                state[i] = idle_state;
+                lane[i]  = NULL;
+            }
+        }
+
+        sha256_block_mb( state, lane, min );
+
+        for( i = 0; i < n; i++ )
+        {
+            if( ! blocks[i] )
+                continue;
+            data[i]   += min << 6;
+            blocks[i] -= min;
+        }
+    }
+
+    for( i = 0; i < n; i++ )
+    {
+        if( blocks[i] )
+            sha256_block( ctx[i], data[i], blocks[i] );
+        /* the buffer is empty, so this just stashes the tail */
+        if( tail[i] )
+        {
+            CopyMem( (void *) ctx[i]->buffer,
+                     (void *) ( data[i] + ( blocks[i] << 6 ) ), tail[i] );
+            sha256_add_length( ctx[i], tail[i] );
+        }
+    }
+}
+
+/*
+ * Update n independent contexts, each with its own input.  Where the CPU
+ * has a multi-buffer kernel the full blocks of up to SHA256_MB_LANES
+ * inputs are compressed together, otherwise this is just n calls to
+ * sha256_update().
+ */
+void sha256_update_multi( sha256_context *ctx[], uint8 *input[],
+                          uint32 length[], int n )
+{
+    int i, lanes;
+
+    if( ! sha256_block_mb )
+    {
+        for( i = 0; i < n; i++ )
+            sha256_update( ctx[i], input[i], length[i] );
+        return;
+    }
+
+    for( i = 0; i < n; i += lanes )
+    {
+        lanes = n - i < SHA256_MB_LANES ? n - i : SHA256_MB_LANES;
+        sha256_update_mb( ctx + i, input + i, length + i, lanes );
+    }
+}
+
 static uint8 sha256_padding[64] =
 {
  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -272,19 +828,26 @@ void sha256_finish( sha256_context *ctx, uint8 digest[SHA256_DIGEST_SIZE] )
     PUT_UINT32( ctx->state[7], digest, 28 );
 }
 
+/*
+ * Work out the parts of a PE image covered by its Authenticode digest:
+ * the headers less the CheckSum and the certificate table directory
+ * entry, the sections in file order and whatever follows them less the
+ * certificate table itself.  Offsets are relative to the start of the
+ * image.
+ */
 EFI_STATUS
-sha256_get_pecoff_digest_mem(void *buffer, UINTN DataSize,
-			     UINT8 hash[SHA256_DIGEST_SIZE])
+sha256_pecoff_ranges(void *buffer, UINTN DataSize, sha256_range **ranges,
+		     int *count)
 {
 	PE_COFF_LOADER_IMAGE_CONTEXT context;
-	sha256_context ctx;
 	void *hashbase;
 	unsigned int hashsize;
 	EFI_IMAGE_SECTION_HEADER *section;
 	EFI_IMAGE_SECTION_HEADER **sections;
-	int  i, sum_of_bytes, checksum_size;
+	int  i, n = 0, sum_of_bytes, checksum_size;
 	EFI_STATUS efi_status;
 	void *checksum_ptr;
+	sha256_range *r;
 
 	/* add extra end alignment; rely on data buffer being zero
 	 * filled to the end of the page */
@@ -308,26 +871,28 @@ sha256_get_pecoff_digest_mem(void *buffer, UINTN DataSize,
 	if (!sections)
 		return EFI_OUT_OF_RESOURCES;
 
-	sha256_starts(&ctx);
+	/* three header pieces, the sections and the trailing data */
+	r = AllocatePool((context.NumberOfSections + 4) * sizeof(*r));
+	if (!r) {
+		FreePool(sections);
+		return EFI_OUT_OF_RESOURCES;
+	}
 
 	/* hash start to checksum */
-	hashbase = buffer;
-	hashsize = checksum_ptr - buffer;
-		
-	sha256_update(&ctx, hashbase, hashsize);
+	r[n].offset = 0;
+	r[n++].size = checksum_ptr - buffer;
 
 	/* hash post-checksum to start of certificate table */
 	hashbase = checksum_ptr + checksum_size;
-	hashsize = (void *)context.SecDir - hashbase;
-
-	sha256_update(&ctx, hashbase, hashsize);
+	r[n].offset = hashbase - buffer;
+	r[n++].size = (void *)context.SecDir - hashbase;
 		
 	/* Hash end of certificate table to end of image header */
 	hashbase = context.SecDir + 1;
-	hashsize = context.SizeOfHeaders -
+	r[n].offset = hashbase - buffer;
+	r[n++].size = context.SizeOfHeaders -
 	  (int) (hashbase - buffer);
 
-	sha256_update(&ctx, hashbase, hashsize);
 	sum_of_bytes = context.SizeOfHeaders;
 	section = (EFI_IMAGE_SECTION_HEADER *) ((char *)context.PEHdr + sizeof (UINT32) + sizeof (EFI_IMAGE_FILE_HEADER) + context.PEHdr->Pe32.FileHeader.SizeOfOptionalHeader);
 	/* Sort the section headers by their data pointers */
@@ -342,28 +907,529 @@ sha256_get_pecoff_digest_mem(void *buffer, UINTN DataSize,
 	/* hash the sorted sections */
 	for (i = 0; i < context.NumberOfSections; i++) {
 		section = sections[i];
-		hashbase  = pecoff_image_address(buffer, DataSize, section->PointerToRawData);
 		hashsize  = (unsigned int) ALIGN_VALUE(section->SizeOfRawData,
 						       context.FileAlignment);
 		if (hashsize == 0)
 			continue;
-		sha256_update(&ctx, hashbase, hashsize);
+		if (!pecoff_image_address(buffer, DataSize, section->PointerToRawData)) {
+			Print(L"Section overflows binary\n");
+			FreePool(sections);
+			FreePool(r);
+			return EFI_INVALID_PARAMETER;
+		}
+		r[n].offset = section->PointerToRawData;
+		r[n++].size = hashsize;
 		sum_of_bytes += hashsize;
 	}
 
 	if (DataSize > sum_of_bytes) {
 		/* stuff at end to hash */
-		hashbase = buffer + sum_of_bytes;
-		hashsize = (unsigned int)(DataSize - context.SecDir->Size - sum_of_bytes);
-		sha256_update(&ctx, hashbase, hashsize);
+		r[n].offset = sum_of_bytes;
+		r[n++].size = (unsigned int)(DataSize - context.SecDir->Size - sum_of_bytes);
 	}
-	sha256_finish(&ctx, hash);
 
 	FreePool(sections);
 
+	*ranges = r;
+	*count = n;
+
 	return EFI_SUCCESS;
 }
 
+static void *
+sha256_engine_init(const digest_engine *engine)
+{
+	sha256_context *ctx = AllocatePool(sizeof(*ctx));
+
+	if (ctx)
+		sha256_starts(ctx);
+	return ctx;
+}
+
+static void
+sha256_engine_update(void *ctx, void *data, UINTN len)
+{
+	/* sha256_update() only takes 32 bits of length */
+	while (len) {
+		uint32 n = len > 0x40000000 ? 0x40000000 : len;
+
+		sha256_update(ctx, data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+sha256_engine_final(void *ctx, UINT8 *digest)
+{
+	sha256_finish(ctx, digest);
+	FreePool(ctx);
+}
+
+const digest_engine sha256_engine = {
+	.name = "sha256",
+	.size = SHA256_DIGEST_SIZE,
+	.init = sha256_engine_init,
+	.update = sha256_engine_update,
+	.final = sha256_engine_final,
+};
+
+/*
+ * The engine behind the sha256_get_pecoff_digest_*() calls: userspace
+ * hands the work to OpenSSL, which has its own optimised sha256 for
+ * every platform; EFI has only the embedded one.
+ */
+#ifdef BUILD_EFI
+#define SHA256_ENGINE	(&sha256_engine)
+#else
+#define SHA256_ENGINE	(&evp_sha256_engine)
+#endif
+
+/*
+ * Start a context for each of the n engines.  If one can't be had, the
+ * ones already started are finished off and NULL is returned.
+ */
+static void **
+pecoff_digests_init(const digest_engine *engine[], int n)
+{
+	void **ctx = AllocatePool(n * sizeof(*ctx));
+	UINT8 discard[DIGEST_MAX_SIZE];
+	int i;
+
+	if (!ctx)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		ctx[i] = engine[i]->init(engine[i]);
+		if (ctx[i])
+			continue;
+		while (i--)
+			engine[i]->final(ctx[i], discard);
+		FreePool(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void
+pecoff_digests_update(const digest_engine *engine[], void **ctx, int n,
+		      void *data, UINTN len)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		engine[i]->update(ctx[i], data, len);
+}
+
+static void
+pecoff_digests_final(const digest_engine *engine[], void **ctx, int n,
+		     UINT8 *hash[])
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		engine[i]->final(ctx[i], hash[i]);
+	FreePool(ctx);
+}
+
+/*
+ * The Authenticode digests of the image in buffer under each of the n
+ * engines, with one walk of the image: hash[i] gets engine[i]'s digest.
+ */
+EFI_STATUS
+pecoff_digests_mem(const digest_engine *engine[], int n, void *buffer,
+		   UINTN DataSize, UINT8 *hash[])
+{
+	void **ctx;
+	sha256_range *ranges;
+	int i, count;
+	EFI_STATUS efi_status;
+
+	efi_status = sha256_pecoff_ranges(buffer, DataSize, &ranges, &count);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
+	ctx = pecoff_digests_init(engine, n);
+	if (!ctx) {
+		FreePool(ranges);
+		return EFI_OUT_OF_RESOURCES;
+	}
+	for (i = 0; i < count; i++)
+		pecoff_digests_update(engine, ctx, n, buffer + ranges[i].offset,
+				      ranges[i].size);
+	pecoff_digests_final(engine, ctx, n, hash);
+
+	FreePool(ranges);
+
+	return EFI_SUCCESS;
+}
+
+/* the Authenticode digest of the image in buffer, using engine */
+EFI_STATUS
+pecoff_digest_mem(const digest_engine *engine, void *buffer, UINTN DataSize,
+		  UINT8 *hash)
+{
+	return pecoff_digests_mem(&engine, 1, buffer, DataSize, &hash);
+}
+
+EFI_STATUS
+sha256_get_pecoff_digest_mem(void *buffer, UINTN DataSize,
+			     UINT8 hash[SHA256_DIGEST_SIZE])
+{
+	return pecoff_digest_mem(SHA256_ENGINE, buffer, DataSize, hash);
+}
+
+/* how much of a range each lane is given per sha256_update_multi() */
+#define SHA256_MB_CHUNK	(64 * 1024)
+
+/*
+ * sha256_get_pecoff_digest_mem() for n images at once.  Up to
+ * SHA256_MB_LANES images are in flight, each fed to
+ * sha256_update_multi() a chunk of its current range at a time so that
+ * the lanes stay roughly level; a lane is refilled with the next image as
+ * soon as its current one is finished.  The status of each image goes
+ * into status[] (if not NULL) and the last failure is returned.
+ */
+EFI_STATUS
+sha256_get_pecoff_digest_mem_multi(void *buffer[], UINTN DataSize[],
+				   UINT8 hash[][SHA256_DIGEST_SIZE],
+				   EFI_STATUS status[], int n)
+{
+	struct {
+		int job;
+		sha256_range *ranges;
+		int count, cur;
+		UINTN done;
+	} lane[SHA256_MB_LANES];
+	sha256_context ctx[SHA256_MB_LANES], *ctxp[SHA256_MB_LANES];
+	uint8 *input[SHA256_MB_LANES];
+	uint32 length[SHA256_MB_LANES];
+	int i, busy, next = 0;
+	EFI_STATUS efi_status, ret = EFI_SUCCESS;
+
+	for (i = 0; i < SHA256_MB_LANES; i++)
+		lane[i].job = -1;
+
+	for (;;) {
+		/* refill idle lanes */
+		for (i = 0; i < SHA256_MB_LANES; i++) {
+			while (lane[i].job == -1 && next < n) {
+				int j = next++;
+
+				efi_status = sha256_pecoff_ranges(buffer[j], DataSize[j],
+								  &lane[i].ranges,
+								  &lane[i].count);
+				if (status)
+					status[j] = efi_status;
+				if (efi_status != EFI_SUCCESS) {
+					ret = efi_status;
+					continue;
+				}
+				lane[i].job = j;
+				lane[i].cur = 0;
+				lane[i].done = 0;
+				sha256_starts(&ctx[i]);
+			}
+		}
+
+		busy = 0;
+		for (i = 0; i < SHA256_MB_LANES; i++) {
+			sha256_range *r;
+			UINTN left;
+
+			if (lane[i].job == -1)
+				continue;
+			r = &lane[i].ranges[lane[i].cur];
+			left = r->size - lane[i].done;
+			ctxp[busy] = &ctx[i];
+			input[busy] = buffer[lane[i].job] + r->offset + lane[i].done;
+			length[busy] = left < SHA256_MB_CHUNK ? left : SHA256_MB_CHUNK;
+			busy++;
+		}
+		if (!busy)
+			break;
+
+		sha256_update_multi(ctxp, input, length, busy);
+
+		busy = 0;
+		for (i = 0; i < SHA256_MB_LANES; i++) {
+			if (lane[i].job == -1)
+				continue;
+			lane[i].done += length[busy++];
+			if (lane[i].done < lane[i].ranges[lane[i].cur].size)
+				continue;
+			lane[i].done = 0;
+			if (++lane[i].cur < lane[i].count)
+				continue;
+			sha256_finish(&ctx[i], hash[lane[i].job]);
+			FreePool(lane[i].ranges);
+			lane[i].job = -1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * The streaming digest reads the image through a source: start() begins
+ * fetching len bytes at off into buf and finish() waits for that to
+ * complete, zero filling anything past the end of the file.  Only one
+ * fetch is in flight at a time, and the digest hashes the previous chunk
+ * between the two calls, so a source that can read in the background
+ * overlaps the I/O with the hashing.
+ */
+typedef struct {
+	EFI_STATUS (*start)(void *handle, UINTN off, void *buf, UINTN len);
+	EFI_STATUS (*finish)(void *handle);
+	void *handle;
+	UINTN size;
+} sha256_source;
+
+/* how much of the image is read at a time, and the alignment of reads */
+#define SHA256_STREAM_CHUNK	(1024 * 1024)
+
+static EFI_STATUS
+sha256_source_read(sha256_source *src, UINTN off, void *buf, UINTN len)
+{
+	EFI_STATUS efi_status;
+
+	efi_status = src->start(src->handle, off, buf, len);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+	return src->finish(src->handle);
+}
+
+/*
+ * Read the headers of the image, growing the buffer until it holds both
+ * the section table and SizeOfHeaders.
+ */
+static EFI_STATUS
+sha256_read_pecoff_headers(sha256_source *src, void **header, UINTN *len)
+{
+	UINTN need = 4096, lfanew;
+	EFI_IMAGE_DOS_HEADER *DosHdr;
+	EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr;
+	EFI_STATUS efi_status;
+	void *buf;
+
+	for (;;) {
+		if (need > ALIGN_VALUE(src->size, 4096)) {
+			Print(L"Image headers overflow binary\n");
+			return EFI_INVALID_PARAMETER;
+		}
+		buf = AllocatePool(need);
+		if (!buf)
+			return EFI_OUT_OF_RESOURCES;
+		efi_status = sha256_source_read(src, 0, buf, need);
+		if (efi_status != EFI_SUCCESS) {
+			FreePool(buf);
+			return efi_status;
+		}
+
+		DosHdr = buf;
+		lfanew = DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE
+			? DosHdr->e_lfanew : 0;
+		if (lfanew + sizeof(EFI_IMAGE_NT_HEADERS64) > need) {
+			need = lfanew + sizeof(EFI_IMAGE_NT_HEADERS64);
+			FreePool(buf);
+			continue;
+		}
+
+		PEHdr = buf + lfanew;
+		*len = lfanew + sizeof(UINT32) + sizeof(EFI_IMAGE_FILE_HEADER)
+			+ PEHdr->Pe32.FileHeader.SizeOfOptionalHeader
+			+ PEHdr->Pe32.FileHeader.NumberOfSections
+			* sizeof(EFI_IMAGE_SECTION_HEADER);
+		if (PEHdr->Pe32.OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+			if (PEHdr->Pe32Plus.OptionalHeader.SizeOfHeaders > *len)
+				*len = PEHdr->Pe32Plus.OptionalHeader.SizeOfHeaders;
+		} else {
+			if (PEHdr->Pe32.OptionalHeader.SizeOfHeaders > *len)
+				*len = PEHdr->Pe32.OptionalHeader.SizeOfHeaders;
+		}
+		if (*len <= need)
+			break;
+		need = *len;
+		FreePool(buf);
+	}
+
+	*header = buf;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Step to the next piece of the image to hash: the rest of the current
+ * range, cut at the next SHA256_STREAM_CHUNK boundary of the file so
+ * that reads stay aligned.  Returns 0 when there's nothing left.
+ */
+static int
+sha256_next_piece(sha256_range *ranges, int count, int *i, UINTN *done,
+		  UINTN *off, UINTN *len)
+{
+	UINTN end;
+
+	while (*i < count && *done == ranges[*i].size) {
+		(*i)++;
+		*done = 0;
+	}
+	if (*i == count)
+		return 0;
+
+	*off = ranges[*i].offset + *done;
+	end = (*off / SHA256_STREAM_CHUNK + 1) * SHA256_STREAM_CHUNK;
+	*len = ranges[*i].size - *done;
+	if (*off + *len > end)
+		*len = end - *off;
+	*done += *len;
+	return 1;
+}
+
+/*
+ * pecoff_digests_mem() for an image that is read from src.  Only the
+ * headers are kept; everything else goes through two chunk buffers, one
+ * being hashed while the source fills the other.
+ */
+static EFI_STATUS
+pecoff_digests_source(const digest_engine *engine[], int n,
+		      sha256_source *src, UINT8 *hash[])
+{
+	void *header, *chunk[2] = { NULL, NULL }, **ctx;
+	UINTN header_len, off, len, next_off, next_len, done = 0;
+	sha256_range *ranges;
+	int i = 0, count, cur = 0, more;
+	EFI_STATUS efi_status;
+
+	efi_status = sha256_read_pecoff_headers(src, &header, &header_len);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
+	efi_status = sha256_pecoff_ranges(header, src->size, &ranges, &count);
+	if (efi_status != EFI_SUCCESS)
+		goto out_free_header;
+
+	chunk[0] = AllocatePool(SHA256_STREAM_CHUNK);
+	chunk[1] = AllocatePool(SHA256_STREAM_CHUNK);
+	ctx = chunk[0] && chunk[1] ? pecoff_digests_init(engine, n) : NULL;
+	if (!ctx) {
+		efi_status = EFI_OUT_OF_RESOURCES;
+		goto out_free_chunk;
+	}
+
+	more = sha256_next_piece(ranges, count, &i, &done, &off, &len);
+	if (more && off + len > header_len)
+		efi_status = sha256_source_read(src, off, chunk[cur], len);
+	while (more && efi_status == EFI_SUCCESS) {
+		void *data = off + len <= header_len
+			? header + off : chunk[cur];
+
+		/* get the next piece coming in while this one is hashed */
+		more = sha256_next_piece(ranges, count, &i, &done, &next_off,
+					 &next_len);
+		if (more && next_off + next_len > header_len) {
+			efi_status = src->start(src->handle, next_off,
+						chunk[!cur], next_len);
+			if (efi_status != EFI_SUCCESS)
+				break;
+			pecoff_digests_update(engine, ctx, n, data, len);
+			efi_status = src->finish(src->handle);
+			cur = !cur;
+		} else {
+			pecoff_digests_update(engine, ctx, n, data, len);
+		}
+		off = next_off;
+		len = next_len;
+	}
+
+	/* always called, it is what frees the contexts */
+	pecoff_digests_final(engine, ctx, n, hash);
+ out_free_chunk:
+	if (chunk[0])
+		FreePool(chunk[0]);
+	if (chunk[1])
+		FreePool(chunk[1]);
+	FreePool(ranges);
+ out_free_header:
+	FreePool(header);
+	return efi_status;
+}
+
+#ifndef BUILD_EFI
+struct sha256_fd_source {
+	int fd;
+	UINTN off, len;
+	void *buf;
+};
+
+/* the kernel does the background read; just ask it to start */
+static EFI_STATUS
+sha256_fd_start(void *handle, UINTN off, void *buf, UINTN len)
+{
+	struct sha256_fd_source *s = handle;
+
+	s->off = off;
+	s->len = len;
+	s->buf = buf;
+	posix_fadvise(s->fd, off, len, POSIX_FADV_WILLNEED);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS
+sha256_fd_finish(void *handle)
+{
+	struct sha256_fd_source *s = handle;
+	UINTN done = 0;
+
+	while (done < s->len) {
+		ssize_t r = pread(s->fd, s->buf + done, s->len - done,
+				  s->off + done);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return EFI_DEVICE_ERROR;
+		if (r == 0) {
+			memset(s->buf + done, 0, s->len - done);
+			break;
+		}
+		done += r;
+	}
+	return EFI_SUCCESS;
+}
+
+/* pecoff_digests_mem() for the image in fd, read a chunk at a time */
+EFI_STATUS
+pecoff_digests_fd(const digest_engine *engine[], int n, int fd,
+		  UINT8 *hash[])
+{
+	struct sha256_fd_source fs = { .fd = fd };
+	sha256_source src = {
+		.start = sha256_fd_start,
+		.finish = sha256_fd_finish,
+		.handle = &fs,
+	};
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return EFI_DEVICE_ERROR;
+	src.size = st.st_size;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return pecoff_digests_source(engine, n, &src, hash);
+}
+
+EFI_STATUS
+pecoff_digest_fd(const digest_engine *engine, int fd, UINT8 *hash)
+{
+	return pecoff_digests_fd(&engine, 1, fd, &hash);
+}
+
+EFI_STATUS
+sha256_get_pecoff_digest_fd(int fd, UINT8 hash[SHA256_DIGEST_SIZE])
+{
+	return pecoff_digest_fd(SHA256_ENGINE, fd, hash);
+}
+#endif
+
 #ifdef BUILD_EFI
 void
 sha256_StrCat_hash(CHAR16 *str, UINT8 hash[SHA256_DIGEST_SIZE])
@@ -378,31 +1444,139 @@ sha256_StrCat_hash(CHAR16 *str, UINT8 hash[SHA256_DIGEST_SIZE])
 	}
 }
 
+/*
+ * The UEFI 2.3.1 (revision 2) additions to the file protocol, which not
+ * every gnu-efi has.  Only ReadEx is used.
+ */
+#define SHA256_FILE_REVISION2	0x00020000
+
+typedef struct {
+	EFI_EVENT Event;
+	EFI_STATUS Status;
+	UINTN BufferSize;
+	VOID *Buffer;
+} SHA256_FILE_IO_TOKEN;
+
+typedef struct {
+	UINT64 Revision;
+	VOID *Functions[10];	/* Open to Flush */
+	VOID *OpenEx;
+	EFI_STATUS (EFIAPI *ReadEx)(EFI_FILE *File, SHA256_FILE_IO_TOKEN *Token);
+	VOID *WriteEx;
+	VOID *FlushEx;
+} SHA256_FILE_PROTOCOL2;
+
+struct sha256_file_source {
+	EFI_FILE *file;
+	int async;		/* ReadEx is usable */
+	UINT64 pos;
+	UINTN len;
+	void *buf;
+	SHA256_FILE_IO_TOKEN token;
+};
+
+static EFI_STATUS
+sha256_file_start(void *handle, UINTN off, void *buf, UINTN len)
+{
+	struct sha256_file_source *s = handle;
+	SHA256_FILE_PROTOCOL2 *f2 = (void *)s->file;
+	EFI_STATUS efi_status;
+
+	if (s->pos != off) {
+		efi_status = uefi_call_wrapper(s->file->SetPosition, 2,
+					       s->file, off);
+		if (efi_status != EFI_SUCCESS)
+			return efi_status;
+		s->pos = off;
+	}
+	s->len = len;
+	s->buf = buf;
+	if (!s->async)
+		return EFI_SUCCESS;
+
+	s->token.Status = EFI_SUCCESS;
+	s->token.BufferSize = len;
+	s->token.Buffer = buf;
+	efi_status = uefi_call_wrapper(f2->ReadEx, 2, s->file, &s->token);
+	if (efi_status == EFI_UNSUPPORTED) {
+		/* the driver can't; do plain reads from now on */
+		uefi_call_wrapper(BS->CloseEvent, 1, s->token.Event);
+		s->async = 0;
+		return EFI_SUCCESS;
+	}
+	return efi_status;
+}
+
+static EFI_STATUS
+sha256_file_finish(void *handle)
+{
+	struct sha256_file_source *s = handle;
+	UINTN got = s->len;
+	EFI_STATUS efi_status;
+
+	if (s->async) {
+		/* poll rather than WaitForEvent(), which is only allowed
+		 * at TPL_APPLICATION */
+		while (uefi_call_wrapper(BS->CheckEvent, 1, s->token.Event)
+		       == EFI_NOT_READY)
+			;
+		efi_status = s->token.Status;
+		got = s->token.BufferSize;
+	} else {
+		efi_status = uefi_call_wrapper(s->file->Read, 3, s->file,
+					       &got, s->buf);
+	}
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+	s->pos += got;
+	if (got < s->len)
+		ZeroMem(s->buf + got, s->len - got);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Get the digest of a file without reading it all in first: the image
+ * is read a chunk at a time and, where the file system driver can do
+ * asynchronous reads, the next chunk is read while the current one is
+ * hashed.
+ */
 EFI_STATUS
 sha256_get_pecoff_digest(EFI_HANDLE device, CHAR16 *name, uint8 hash[SHA256_DIGEST_SIZE])
 {
+	const digest_engine *engine = SHA256_ENGINE;
+	struct sha256_file_source fs = { .pos = 0 };
+	sha256_source src = {
+		.start = sha256_file_start,
+		.finish = sha256_file_finish,
+		.handle = &fs,
+	};
 	EFI_STATUS efi_status;
-	EFI_FILE *file;
-	UINTN DataSize;
-	void *buffer;
-	
-	efi_status = simple_file_open(device, name, &file, EFI_FILE_MODE_READ);
+
+	efi_status = simple_file_open(device, name, &fs.file, EFI_FILE_MODE_READ);
 	if (efi_status != EFI_SUCCESS) {
 		Print(L"Failed to open %s\n", name);
 		return efi_status;
 	}
 
-	efi_status = simple_file_read_all(file, &DataSize, &buffer);
+	efi_status = simple_file_size(fs.file, &src.size);
 	if (efi_status != EFI_SUCCESS) {
 		Print(L"Failed to read %s\n", name);
 		goto out_close_file;
 	}
 
-	efi_status = sha256_get_pecoff_digest_mem(buffer, DataSize, hash);
+	if (fs.file->Revision >= SHA256_FILE_REVISION2
+	    && uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				 &fs.token.Event) == EFI_SUCCESS)
+		fs.async = 1;
+
+	efi_status = pecoff_digests_source(&engine, 1, &src, &hash);
+	if (efi_status != EFI_SUCCESS)
+		Print(L"Failed to hash %s\n", name);
 
-	FreePool(buffer);
+	if (fs.async)
+		uefi_call_wrapper(BS->CloseEvent, 1, fs.token.Event);
  out_close_file:
-	simple_file_close(file);
+	simple_file_close(fs.file);
 	return efi_status;
 }
 #endif
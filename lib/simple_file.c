@@ -149,7 +149,7 @@ simple_dir_read_all(EFI_HANDLE image, CHAR16 *name, EFI_FILE_INFO **entries,
 }
 
 EFI_STATUS
-simple_file_read_all(EFI_FILE *file, UINTN *size, void **buffer)
+simple_file_size(EFI_FILE *file, UINTN *size)
 {
 	EFI_STATUS efi_status;
 	EFI_FILE_INFO *fi;
@@ -168,6 +168,18 @@ simple_file_read_all(EFI_FILE *file, UINTN *size, void **buffer)
 
 	*size = fi->FileSize;
 
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+simple_file_read_all(EFI_FILE *file, UINTN *size, void **buffer)
+{
+	EFI_STATUS efi_status;
+
+	efi_status = simple_file_size(file, size);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
 	/* might use memory mapped, so align up to nearest page */
 	*buffer = AllocateZeroPool(ALIGN_VALUE(*size, 4096));
 	if (!*buffer) {
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * Synthetic PE images and signature lists for the benchmarks and the
+ * corpus generator.  Only the structure has to be right; the contents
+ * are seeded pseudo-random bytes.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <PeImage.h>
+#include <efiauthenticated.h>
+#include <guid.h>
+#include <sha256.h>
+#include <synth.h>
+
+#define SYNTH_FILE_ALIGN	0x200
+#define SYNTH_SECTION_ALIGN	0x1000
+#define SYNTH_IMAGE_BASE	0x10000000ULL
+/* initialised, readable data (the PeImage.h names need EDK2's BITn) */
+#define SYNTH_SCN_DATA		0x40000040
+#define SYNTH_SCN_DISCARDABLE	0x02000000
+
+static UINT64 state = 1;
+
+void
+synth_seed(UINT64 seed)
+{
+	/* xorshift gets stuck at zero */
+	state = seed ? seed : 1;
+}
+
+/* xorshift64*: the data only has to be reproducible, not good */
+UINT64
+synth_random(void)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+void
+synth_fill(void *buf, UINTN len)
+{
+	UINT8 *p = buf;
+	UINT64 r;
+
+	for (; len >= sizeof(r); len -= sizeof(r), p += sizeof(r)) {
+		r = synth_random();
+		memcpy(p, &r, sizeof(r));
+	}
+	r = synth_random();
+	memcpy(p, &r, len);
+}
+
+/*
+ * A PE32+ image of about size bytes in nsec sections.  With relocs the
+ * first section is covered by DIR64 relocations, one every 8 bytes, in a
+ * .reloc section added on the end.
+ */
+void *
+synth_pe_image(UINTN size, int nsec, int relocs, UINTN *len, UINTN *nrelocs)
+{
+	EFI_IMAGE_DOS_HEADER *dos;
+	EFI_IMAGE_NT_HEADERS64 *pe;
+	EFI_IMAGE_SECTION_HEADER *s;
+	UINTN secsize, relocsize = 0, pages = 0, total, hdrsize;
+	UINT8 *image;
+	int i, j;
+
+	if (nsec < 1 || nsec >= 0xffff)
+		return NULL;
+	/* DOS header, PE headers and the section table (plus .reloc) */
+	hdrsize = ALIGN_VALUE(0x80 + sizeof(*pe) + (nsec + 1) * sizeof(*s),
+			      SYNTH_FILE_ALIGN);
+
+	secsize = ALIGN_VALUE(size / nsec, SYNTH_SECTION_ALIGN);
+	if (!secsize)
+		secsize = SYNTH_SECTION_ALIGN;
+	if (relocs) {
+		pages = secsize / SYNTH_SECTION_ALIGN;
+		relocsize = pages * (sizeof(EFI_IMAGE_BASE_RELOCATION)
+				     + SYNTH_SECTION_ALIGN / 8 * sizeof(UINT16));
+	}
+	total = hdrsize + nsec * secsize
+		+ ALIGN_VALUE(relocsize, SYNTH_FILE_ALIGN);
+	image = calloc(1, total);
+	if (!image)
+		return NULL;
+	synth_fill(image + hdrsize, nsec * secsize);
+
+	dos = (void *)image;
+	dos->e_magic = EFI_IMAGE_DOS_SIGNATURE;
+	dos->e_lfanew = 0x80;
+	pe = (void *)image + dos->e_lfanew;
+	pe->Signature = EFI_IMAGE_NT_SIGNATURE;
+	pe->FileHeader.Machine = 0x8664;
+	pe->FileHeader.NumberOfSections = nsec + !!relocs;
+	pe->FileHeader.SizeOfOptionalHeader = sizeof(pe->OptionalHeader);
+	pe->FileHeader.Characteristics = EFI_IMAGE_FILE_EXECUTABLE_IMAGE;
+	pe->OptionalHeader.Magic = EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+	pe->OptionalHeader.ImageBase = SYNTH_IMAGE_BASE;
+	pe->OptionalHeader.SectionAlignment = SYNTH_SECTION_ALIGN;
+	pe->OptionalHeader.FileAlignment = SYNTH_FILE_ALIGN;
+	pe->OptionalHeader.SizeOfHeaders = hdrsize;
+	pe->OptionalHeader.Subsystem = EFI_IMAGE_SUBSYSTEM_EFI_APPLICATION;
+	pe->OptionalHeader.NumberOfRvaAndSizes = EFI_IMAGE_NUMBER_OF_DIRECTORY_ENTRIES;
+
+	s = (void *)(pe + 1);
+	for (i = 0; i < nsec; i++, s++) {
+		sprintf((char *)s->Name, ".s%d", i);
+		s->Misc.VirtualSize = secsize;
+		s->VirtualAddress = ALIGN_VALUE(hdrsize, SYNTH_SECTION_ALIGN)
+			+ i * secsize;
+		s->SizeOfRawData = secsize;
+		s->PointerToRawData = hdrsize + i * secsize;
+		s->Characteristics = SYNTH_SCN_DATA;
+	}
+	pe->OptionalHeader.SizeOfImage = (s - 1)->VirtualAddress + secsize;
+
+	if (relocs) {
+		EFI_IMAGE_SECTION_HEADER *text = (void *)(pe + 1);
+		EFI_IMAGE_DATA_DIRECTORY *dir = &pe->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
+		UINT8 *r = image + hdrsize + nsec * secsize;
+
+		memcpy(s->Name, ".reloc", 6);
+		s->Misc.VirtualSize = relocsize;
+		s->VirtualAddress = pe->OptionalHeader.SizeOfImage;
+		s->SizeOfRawData = ALIGN_VALUE(relocsize, SYNTH_FILE_ALIGN);
+		s->PointerToRawData = hdrsize + nsec * secsize;
+		s->Characteristics = SYNTH_SCN_DATA | SYNTH_SCN_DISCARDABLE;
+		dir->VirtualAddress = s->VirtualAddress;
+		dir->Size = relocsize;
+		pe->OptionalHeader.SizeOfImage += ALIGN_VALUE(relocsize, SYNTH_SECTION_ALIGN);
+
+		for (i = 0; i < pages; i++) {
+			EFI_IMAGE_BASE_RELOCATION *b = (void *)r;
+			UINT16 *e = (void *)(b + 1);
+
+			b->VirtualAddress = text->VirtualAddress + i * SYNTH_SECTION_ALIGN;
+			b->SizeOfBlock = sizeof(*b) + SYNTH_SECTION_ALIGN / 8 * sizeof(*e);
+			for (j = 0; j < SYNTH_SECTION_ALIGN / 8; j++)
+				e[j] = EFI_IMAGE_REL_BASED_DIR64 << 12 | j * 8;
+			r += b->SizeOfBlock;
+		}
+	}
+
+	*len = total;
+	if (nrelocs)
+		*nrelocs = pages * SYNTH_SECTION_ALIGN / 8;
+	return image;
+}
+
+/* a single EFI_CERT_SHA256 signature list of n random hashes */
+void *
+synth_sha256_esl(int n, EFI_GUID *owner, UINTN *len)
+{
+	EFI_SIGNATURE_LIST *l;
+	EFI_SIGNATURE_DATA *d;
+	int i;
+
+	*len = sizeof(*l) + n * (sizeof(EFI_GUID) + SHA256_DIGEST_SIZE);
+	l = calloc(1, *len);
+	if (!l)
+		return NULL;
+	l->SignatureType = EFI_CERT_SHA256_GUID;
+	l->SignatureListSize = *len;
+	l->SignatureSize = sizeof(EFI_GUID) + SHA256_DIGEST_SIZE;
+	d = (void *)(l + 1);
+	for (i = 0; i < n; i++) {
+		d->SignatureOwner = *owner;
+		synth_fill(d->SignatureData, SHA256_DIGEST_SIZE);
+		d = (void *)d + l->SignatureSize;
+	}
+	return l;
+}
+
+/*
+ * n EFI_CERT_X509 signature lists, one certificate each as
+ * cert-to-efi-sig-list makes them.  Every certificate is a copy of the
+ * DER cert with the serial_len bytes of serial number at offset serial
+ * replaced, so they all parse but are all different (none of the
+ * signatures verify, of course).
+ */
+void *
+synth_x509_esl(int n, void *cert, UINTN certlen, UINTN serial,
+	       UINTN serial_len, EFI_GUID *owner, UINTN *len)
+{
+	UINTN size = sizeof(EFI_SIGNATURE_LIST)
+		+ OFFSET_OF(EFI_SIGNATURE_DATA, SignatureData) + certlen;
+	void *esl;
+	int i;
+
+	if (serial + serial_len > certlen)
+		return NULL;
+	*len = n * size;
+	esl = malloc(*len);
+	if (!esl)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		EFI_SIGNATURE_LIST *l = esl + i * size;
+		EFI_SIGNATURE_DATA *d = (void *)(l + 1);
+		UINT8 *c = d->SignatureData;
+
+		l->SignatureType = EFI_CERT_X509_GUID;
+		l->SignatureListSize = size;
+		l->SignatureHeaderSize = 0;
+		l->SignatureSize = size - sizeof(*l);
+		d->SignatureOwner = *owner;
+		memcpy(c, cert, certlen);
+		synth_fill(c + serial, serial_len);
+		/* keep the serial a positive INTEGER */
+		c[serial] &= 0x7f;
+		c[serial] |= 0x01;
+	}
+	return esl;
+}
@@ -244,23 +244,6 @@ get_variable(CHAR16 *var, UINT8 **data, UINTN *len, EFI_GUID owner)
 	return get_variable_attr(var, data, len, owner, NULL);
 }
 
-EFI_STATUS
-find_in_esl(UINT8 *Data, UINTN DataSize, UINT8 *key, UINTN keylen)
-{
-	EFI_SIGNATURE_LIST *CertList;
-
-	certlist_for_each_certentry(CertList, Data, DataSize, DataSize) {
-		if (CertList->SignatureSize != keylen + sizeof(EFI_GUID))
-			continue;
-		EFI_SIGNATURE_DATA *Cert;
-
-		certentry_for_each_cert(Cert, CertList)
-			if (CompareMem (Cert->SignatureData, key, keylen) == 0)
-				return EFI_SUCCESS;
-	}
-	return EFI_NOT_FOUND;
-}
-
 EFI_STATUS
 find_in_variable_esl(CHAR16* var, EFI_GUID owner, UINT8 *key, UINTN keylen)
 {
@@ -312,10 +295,12 @@ variable_enroll_hash(CHAR16 *var, EFI_GUID owner,
 {
 	EFI_STATUS status;
 
-	if (find_in_variable_esl(var, owner, hash, SHA256_DIGEST_SIZE)
-	    == EFI_SUCCESS)
+	status = find_in_variable_esl(var, owner, hash, SHA256_DIGEST_SIZE);
+	if (status == EFI_SUCCESS)
 		/* hash already present */
 		return EFI_ALREADY_STARTED;
+	if (status != EFI_NOT_FOUND)
+		return status;
 
 	UINT8 sig[sizeof(EFI_SIGNATURE_LIST) + sizeof(EFI_SIGNATURE_DATA) - 1 + SHA256_DIGEST_SIZE];
 	EFI_SIGNATURE_LIST *l = (void *)sig;
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2013 <James.Bottomley@HansenPartnership.com>
+ *
+ * see COPYING file
+ *
+ * Signing authenticated variable updates (EFI_VARIABLE_AUTHENTICATION_2)
+ * with OpenSSL, for the userspace tools.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/pkcs7.h>
+#include <openssl/x509.h>
+
+#define __STDC_VERSION__ 199901L
+#include <efi.h>
+
+#include <efiauthenticated.h>
+#include <varsign.h>
+
+/*
+ * What the signature of an update covers: the variable name (UCS-2, no
+ * terminator), the vendor GUID, the attributes, the timestamp and the
+ * data.
+ */
+void *
+variable_sign_bundle(const char *var, EFI_GUID *vendor, UINT32 attributes,
+		     EFI_TIME *timestamp, void *data, UINTN datalen,
+		     UINTN *len)
+{
+	UINTN varlen = strlen(var) * sizeof(CHAR16);
+	unsigned char *bundle, *ptr;
+	int i;
+
+	*len = varlen + sizeof(*vendor) + sizeof(attributes)
+		+ sizeof(*timestamp) + datalen;
+	bundle = malloc(*len);
+	if (!bundle)
+		return NULL;
+	ptr = bundle;
+	/* don't use any glibc wchar functions, we build with -fshort-wchar */
+	for (i = 0; var[i]; i++, ptr += sizeof(CHAR16))
+		*(CHAR16 *)ptr = var[i];
+	memcpy(ptr, vendor, sizeof(*vendor));
+	ptr += sizeof(*vendor);
+	memcpy(ptr, &attributes, sizeof(attributes));
+	ptr += sizeof(attributes);
+	memcpy(ptr, timestamp, sizeof(*timestamp));
+	ptr += sizeof(*timestamp);
+	memcpy(ptr, data, datalen);
+	return bundle;
+}
+
+/*
+ * The detached sha256 PKCS7 signature of bundle, in DER.  flags are
+ * added to the PKCS7 signing flags, e.g. PKCS7_NOATTR.
+ */
+unsigned char *
+variable_sign_pkcs7(void *bundle, UINTN len, X509 *cert, EVP_PKEY *pkey,
+		    int flags, int *sigsize)
+{
+	BIO *bio = BIO_new_mem_buf(bundle, len);
+	unsigned char *sig = NULL, *ptr;
+	PKCS7 *p7 = NULL;
+
+	flags |= PKCS7_BINARY | PKCS7_DETACHED;
+	if (!bio)
+		goto out;
+	p7 = PKCS7_sign(NULL, NULL, NULL, bio, flags | PKCS7_PARTIAL);
+	if (!p7
+	    || !PKCS7_sign_add_signer(p7, cert, pkey, EVP_sha256(), flags)
+	    || !PKCS7_final(p7, bio, flags))
+		goto out;
+	*sigsize = i2d_PKCS7(p7, NULL);
+	if (*sigsize <= 0)
+		goto out;
+	sig = malloc(*sigsize);
+	if (!sig)
+		goto out;
+	ptr = sig;
+	if (i2d_PKCS7(p7, &ptr) != *sigsize) {
+		free(sig);
+		sig = NULL;
+	}
+ out:
+	PKCS7_free(p7);
+	BIO_free(bio);
+	return sig;
+}
+
+/*
+ * The complete update of var to data: the authentication header with
+ * the signature, then the data.  headroom bytes are left free in front
+ * of it, for set_variable_headroom(); free it with
+ * free(update - headroom).
+ */
+void *
+variable_sign_update(const char *var, EFI_GUID *vendor, UINT32 attributes,
+		     EFI_TIME *timestamp, void *data, UINTN datalen,
+		     X509 *cert, EVP_PKEY *pkey, int flags, UINTN headroom,
+		     UINTN *len)
+{
+	EFI_VARIABLE_AUTHENTICATION_2 *var_auth;
+	unsigned char *bundle, *sig, *buf = NULL;
+	UINTN bundlelen, hdrlen;
+	int sigsize;
+
+	bundle = variable_sign_bundle(var, vendor, attributes, timestamp,
+				      data, datalen, &bundlelen);
+	if (!bundle)
+		return NULL;
+	sig = variable_sign_pkcs7(bundle, bundlelen, cert, pkey, flags,
+				  &sigsize);
+	free(bundle);
+	if (!sig)
+		return NULL;
+
+	hdrlen = OFFSET_OF(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData)
+		+ sigsize;
+	*len = hdrlen + datalen;
+	buf = malloc(headroom + *len);
+	if (!buf)
+		goto out;
+	var_auth = (void *)(buf + headroom);
+	var_auth->TimeStamp = *timestamp;
+	var_auth->AuthInfo.CertType = EFI_CERT_TYPE_PKCS7_GUID;
+	var_auth->AuthInfo.Hdr.dwLength = sigsize + OFFSET_OF(WIN_CERTIFICATE_UEFI_GUID, CertData);
+	var_auth->AuthInfo.Hdr.wRevision = 0x0200;
+	var_auth->AuthInfo.Hdr.wCertificateType = WIN_CERT_TYPE_EFI_GUID;
+	memcpy(var_auth->AuthInfo.CertData, sig, sigsize);
+	memcpy((unsigned char *)var_auth + hdrlen, data, datalen);
+ out:
+	free(sig);
+	return buf ? buf + headroom : NULL;
+}
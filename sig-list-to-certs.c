@@ -9,6 +9,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -51,47 +52,42 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	void *buf = malloc(st.st_size);
-	if (!buf) {
-		fprintf(stderr, "Malloc failed: ");
-		perror("");
-		exit(1);
-	}
-
-	if (read(fd, buf, st.st_size) != st.st_size) {
-		fprintf(stderr, "Failed to read %d bytes from %s: ",
+	/* the view borrows the mapping, so nothing is copied */
+	void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (st.st_size && buf == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %d bytes of %s: ",
 			(int)st.st_size, efifile);
 		perror("");
 		exit(1);
 	}
 	close(fd);
 
-	EFI_SIGNATURE_LIST *sl;
-	int s, count = 0;
-	certlist_for_each_certentry(sl, buf, s, st.st_size) {
+	static const char *exts[] = {
+		[ESL_TYPE_UNKNOWN] = "txt",
+		[ESL_TYPE_X509] = "der",
+		[ESL_TYPE_RSA2048] = "rsa",
+		[ESL_TYPE_PKCS7] = "pk7",
+		[ESL_TYPE_SHA256] = "hash",
+	};
+	esl_view view;
+	esl_list l;
+	int count = 0;
+
+	if (esl_view_init(&view, buf, st.st_size) != EFI_SUCCESS)
+		fprintf(stderr, "%s: malformed signature list after list %d\n",
+			efifile, (int)view.lists);
+
+	esl_view_for_each_list(&view, &l) {
 		EFI_SIGNATURE_DATA *sd;
-		const char *ext;
-
-		certentry_for_each_cert(sd, sl) {
-
-			if (memcmp(&sl->SignatureType, &EFI_CERT_X509_GUID, sizeof(EFI_GUID)) == 0) {
-				printf("X509 ");
-				ext = "der";
-			} else if (memcmp(&sl->SignatureType, &EFI_CERT_TYPE_PKCS7_GUID, sizeof(EFI_GUID)) == 0) {
-				printf("PKCS7 ");
-				ext = "pk7";
-			} else if (memcmp(&sl->SignatureType, &EFI_CERT_RSA2048_GUID, sizeof(EFI_GUID)) == 0) {
-				printf("RSA2048 ");
-				ext = "rsa";
-			} else if (memcmp(&sl->SignatureType, &EFI_CERT_SHA256_GUID, sizeof(EFI_GUID)) == 0) {
-				printf("SHA256 ");
-				ext = "hash";
-			} else {
-				printf("UNKNOWN ");
-				ext = "txt";
-			}
+		const char *ext = exts[l.type];
+		UINTN i;
+
+		esl_list_for_each_entry(&l, sd, i) {
+			printf("%s ", l.type == ESL_TYPE_UNKNOWN ? "UNKNOWN"
+			       : esl_type_name(l.type));
 			printf("Header sls=%d, header=%d, sig=%d\n",
-			       sl->SignatureListSize, sl->SignatureHeaderSize, sl->SignatureSize - (UINT32)OFFSET_OF(EFI_SIGNATURE_DATA, SignatureData));
+			       l.list->SignatureListSize,
+			       l.list->SignatureHeaderSize, (int)l.data_size);
 
 			EFI_GUID *guid = &sd->SignatureOwner;
 
@@ -99,8 +95,8 @@ main(int argc, char *argv[])
 			printf("file %s: Guid %s\n", name, guid_to_str(guid));
 
 			FILE *g = fopen(name, "w");
-			fwrite(sd->SignatureData, 1, sl->SignatureSize - OFFSET_OF(EFI_SIGNATURE_DATA, SignatureData), g);
-			printf("Written %d bytes\n", sl->SignatureSize - (UINT32)OFFSET_OF(EFI_SIGNATURE_DATA, SignatureData));
+			fwrite(sd->SignatureData, 1, l.data_size, g);
+			printf("Written %d bytes\n", (int)l.data_size);
 			fclose(g);
 		}
 	}
@@ -15,7 +15,6 @@
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
-#include <wchar.h>
 
 #include <openssl/pem.h>
 #include <openssl/err.h>
@@ -23,6 +22,7 @@
 
 #include <variables.h>
 #include <guid.h>
+#include <varsign.h>
 #include <version.h>
 
 static void
@@ -64,11 +64,10 @@ main(int argc, char *argv[])
 	void *out;
 	const char *progname = argv[0];
 	unsigned char *sigbuf;
-	int rsasig = 0, monotonic = 0, varlen, i, outputforsign = 0, outlen,
+	int rsasig = 0, monotonic = 0, outputforsign = 0, outlen,
 		sigsize;
 	EFI_GUID vendor_guid;
 	struct stat st;
-	wchar_t var[256];
 	UINT32 attributes = EFI_VARIABLE_NON_VOLATILE
 		| EFI_VARIABLE_RUNTIME_ACCESS
 		| EFI_VARIABLE_BOOTSERVICE_ACCESS
@@ -182,15 +181,6 @@ main(int argc, char *argv[])
 	       timestamp.Month, timestamp.Day, timestamp.Hour, timestamp.Minute,
 	       timestamp.Second);
 
-	/* Warning: don't use any glibc wchar functions.  We're building
-	 * with -fshort-wchar which breaks the glibc ABI */
-	i = 0;
-	do {
-		var[i] = str[i];
-	} while (str[i++] != '\0');
-
-	varlen = (i - 1)*sizeof(wchar_t);
-
 	int fdefifile = open(efifile, O_RDONLY);
 	if (fdefifile == -1) {
 		fprintf(stderr, "failed to open file %s: ", efifile);
@@ -198,23 +188,25 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 	fstat(fdefifile, &st);
+	char *ptr = malloc(st.st_size);
+	if (!ptr || read(fdefifile, ptr, st.st_size) != st.st_size) {
+		fprintf(stderr, "failed to read file %s\n", efifile);
+		exit(1);
+	}
+	close(fdefifile);
 
 	/* signature is over variable name (no null), the vendor GUID, the
 	 * attributes, the timestamp and the contents */
-	int signbuflen = varlen + sizeof(EFI_GUID) + sizeof(UINT32) + sizeof(EFI_TIME) + st.st_size;
-	char *signbuf = malloc(signbuflen);
-	char *ptr = signbuf;
-	memcpy(ptr, var, varlen);
-	ptr += varlen;
-	memcpy(ptr, &vendor_guid, sizeof(vendor_guid));
-	ptr += sizeof(vendor_guid);
-	memcpy(ptr, &attributes, sizeof(attributes));
-	ptr += sizeof(attributes);
-	memcpy(ptr, &timestamp, sizeof(timestamp));
-	ptr += sizeof(timestamp);
-	read(fdefifile, ptr, st.st_size);
-
-	printf("Authentication Payload size %d\n", signbuflen);
+	UINTN signbuflen;
+	char *signbuf = variable_sign_bundle(str, &vendor_guid, attributes,
+					     &timestamp, ptr, st.st_size,
+					     &signbuflen);
+	if (!signbuf) {
+		fprintf(stderr, "failed to allocate signing buffer\n");
+		exit(1);
+	}
+
+	printf("Authentication Payload size %d\n", (int)signbuflen);
 
 	if (outputforsign) {
 		out = signbuf;
@@ -222,8 +214,6 @@ main(int argc, char *argv[])
 		goto output;
 	}
 
-	PKCS7 *p7;
-
 	if (signedinput) {
 		struct stat sti;
 		int infile = open(signedinput, O_RDONLY);
@@ -265,15 +255,13 @@ main(int argc, char *argv[])
 			exit(1);
 		}
 
-		BIO *bio_data = BIO_new_mem_buf(signbuf, signbuflen);
-	
-		p7 = PKCS7_sign(NULL, NULL, NULL, bio_data, PKCS7_BINARY|PKCS7_PARTIAL|PKCS7_DETACHED|PKCS7_NOATTR);
-		const EVP_MD *md = EVP_get_digestbyname("SHA256");
-		PKCS7_sign_add_signer(p7, cert, pkey, md, PKCS7_BINARY|PKCS7_DETACHED|PKCS7_NOATTR);
-		PKCS7_final(p7, bio_data, PKCS7_BINARY|PKCS7_DETACHED|PKCS7_NOATTR);
-
-
-		sigsize = i2d_PKCS7(p7, NULL);
+		sigbuf = variable_sign_pkcs7(signbuf, signbuflen, cert, pkey,
+					     PKCS7_NOATTR, &sigsize);
+		if (!sigbuf) {
+			fprintf(stderr, "failed to sign %s\n", efifile);
+			ERR_print_errors_fp(stderr);
+			exit(1);
+		}
 	}
 	printf("Signature of size %d\n", sigsize);
 
@@ -285,15 +273,10 @@ main(int argc, char *argv[])
 	var_auth->AuthInfo.Hdr.wRevision = 0x0200;
 	var_auth->AuthInfo.Hdr.wCertificateType = WIN_CERT_TYPE_EFI_GUID;
 
-	if (signedinput) {
-		memcpy(var_auth->AuthInfo.CertData, sigbuf, sigsize);
-		sigbuf = var_auth->AuthInfo.CertData;
-	} else {
-		sigbuf = var_auth->AuthInfo.CertData;
-		printf("Signature at: %ld\n", sigbuf - (unsigned char *)var_auth);
-		i2d_PKCS7(p7, &sigbuf);
-		ERR_print_errors_fp(stdout);
-	}
+	if (!signedinput)
+		printf("Signature at: %ld\n", var_auth->AuthInfo.CertData
+		       - (unsigned char *)var_auth);
+	memcpy(var_auth->AuthInfo.CertData, sigbuf, sigsize);
 
 	out = var_auth;
 	outlen = OFFSET_OF(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData) + sigsize;